@@ -8,6 +8,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -30,20 +31,25 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
+/* Represent allocated blocks as an open-addressing hash set of headers with
+ * linear probing, so that checking whether a block is live takes O(1) rather
+ * than a walk over every allocated block.
+ */
+static block_element_t **allocated = NULL;
+static size_t allocated_capacity = 0; /* Zero or a power of two */
 static size_t allocated_count = 0;
 
+/* Initial number of slots in the hash set */
+#define MIN_CAPACITY 1024
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
@@ -75,6 +81,82 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+/* Home slot of block b in a hash set with the given capacity */
+static inline size_t block_slot(const block_element_t *b, size_t capacity)
+{
+    return random_shuffle((uintptr_t) b) & (capacity - 1);
+}
+
+/* Return the slot holding b, or the empty slot where the probe stopped */
+static size_t block_lookup(const block_element_t *b)
+{
+    size_t mask = allocated_capacity - 1;
+    size_t i = block_slot(b, allocated_capacity);
+    while (allocated[i] && allocated[i] != b)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* Double the hash set, keeping the load factor at most 3/4 */
+static void block_set_grow()
+{
+    size_t capacity =
+        allocated_capacity ? allocated_capacity << 1 : MIN_CAPACITY;
+    block_element_t **table = calloc(capacity, sizeof(block_element_t *));
+    if (!table) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        return;
+    }
+
+    for (size_t i = 0; i < allocated_capacity; i++) {
+        if (!allocated[i])
+            continue;
+        size_t j = block_slot(allocated[i], capacity);
+        while (table[j])
+            j = (j + 1) & (capacity - 1);
+        table[j] = allocated[i];
+    }
+
+    free(allocated);
+    allocated = table;
+    allocated_capacity = capacity;
+}
+
+static void block_set_insert(block_element_t *b)
+{
+    if ((allocated_count + 1) * 4 > allocated_capacity * 3)
+        block_set_grow();
+    allocated[block_lookup(b)] = b;
+    allocated_count++;
+}
+
+static bool block_set_contains(const block_element_t *b)
+{
+    return allocated_capacity && allocated[block_lookup(b)] == b;
+}
+
+/* Remove b, shifting later members of its probe sequence backward so that
+ * no tombstones are needed.
+ */
+static void block_set_remove(const block_element_t *b)
+{
+    if (!block_set_contains(b))
+        return;
+
+    size_t mask = allocated_capacity - 1;
+    size_t hole = block_lookup(b);
+    for (size_t i = (hole + 1) & mask; allocated[i]; i = (i + 1) & mask) {
+        size_t home = block_slot(allocated[i], allocated_capacity);
+        /* Move the entry unless its home lies cyclically in (hole, i] */
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            allocated[hole] = allocated[i];
+            hole = i;
+        }
+    }
+    allocated[hole] = NULL;
+    allocated_count--;
+}
+
 /* Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
  */
@@ -89,13 +171,7 @@ static block_element_t *find_header(void *p)
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!block_set_contains(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -159,15 +235,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    block_set_insert(new_block);
 
     return p;
 }
@@ -235,18 +303,8 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
+    block_set_remove(b);
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
@@ -3,7 +3,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -25,7 +30,7 @@
 #include "random.h"
 
 /* Shannon entropy */
-extern double shannon_entropy(const uint8_t *input_data);
+extern double shannon_entropy(const uint8_t *input_data, size_t len);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -44,6 +49,9 @@ extern int show_entropy;
  * solution code
  */
 #include "queue.h"
+#include "queue_blocking.h"
+#include "queue_mpmc.h"
+#include "queue_spsc.h"
 
 #include "console.h"
 #include "report.h"
@@ -54,7 +62,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -76,9 +83,26 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+static int sort_threads = 1;
+
+static int intern = 0;
+
+static int lazy_reverse = 0;
+
+/* Storage engine of the queues created by the new command */
+static int backend = Q_BACKEND_LIST;
+
+/* Generator used by the shuffle command: 0 for rand(), 1 for xorshift, 2 for
+ * the system CSPRNG
+ */
+static int shuffle_rng = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+
+/* Random strings are generated this many at a time */
+#define RANDSTR_BATCH 1024
 /* For queue_insert and queue_remove */
 typedef enum {
     POS_TAIL,
@@ -102,9 +126,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -117,7 +138,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -128,6 +148,9 @@ static bool do_free(int argc, char *argv[])
 
     q_show(3);
 
+    if (!chain.size)
+        q_shrink_cache();
+
     size_t bcnt = allocation_check();
     if (!chain.size && bcnt > 0) {
         report(1,
@@ -153,7 +176,7 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
-        qctx->q = q_new();
+        qctx->q = q_new_backend(backend);
         qctx->id = chain.size++;
 
         current = qctx;
@@ -164,21 +187,68 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+/* Insert reps copies of inserts, or reps random strings if inserts is NULL,
+ * through the bulk insertion API, RANDSTR_BATCH strings at a time
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+static bool queue_insert_n(position_t pos, char *inserts, int reps)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    char randstr_buf[RANDSTR_BATCH][MAX_RANDSTR_LEN];
+    char *strs[RANDSTR_BATCH];
+    const char *lasts = NULL;
+    bool ok = true;
 
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+    for (int i = 0; i < RANDSTR_BATCH; i++)
+        strs[i] = inserts ? inserts : randstr_buf[i];
+
+    for (int r = 0; ok && r < reps; r += RANDSTR_BATCH) {
+        size_t n = reps - r < RANDSTR_BATCH ? reps - r : RANDSTR_BATCH;
+        if (!inserts)
+            random_strings(randstr_buf[0], n, MAX_RANDSTR_LEN, MIN_RANDSTR_LEN,
+                           charset, sizeof(charset) - 1);
+        bool rval = pos == POS_TAIL ? q_insert_tail_n(current->q, strs, n)
+                                    : q_insert_head_n(current->q, strs, n);
+        if (!rval) {
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Insertion of %zu strings failed", n);
+            else {
+                report(1,
+                       "ERROR: Insertion of %zu strings failed (%d failures "
+                       "total)",
+                       n, fail_count);
+                ok = false;
+            }
+            ok = ok && !error_check();
+            continue;
+        }
 
-    buf[len] = '\0';
+        current->size += n;
+        /* Walk the new elements from the last string of strs backwards */
+        q_iter_t it;
+        bool more = pos == POS_TAIL ? q_iter_last(current->q, &it)
+                                    : q_iter_first(current->q, &it);
+        for (size_t i = n; ok && i-- > 0;) {
+            const char *cur_inserts = more ? it.value : NULL;
+            if (!cur_inserts) {
+                report(1, "ERROR: Failed to save copy of string in queue");
+                ok = false;
+            } else if (cur_inserts == strs[i]) {
+                report(1,
+                       "ERROR: Need to allocate and copy string for new "
+                       "queue element");
+                ok = false;
+            } else if (!intern && cur_inserts == lasts) {
+                report(1,
+                       "ERROR: Need to allocate separate string for each "
+                       "queue element");
+                ok = false;
+            }
+            lasts = cur_inserts;
+            more = pos == POS_TAIL ? q_iter_prev(&it) : q_iter_next(&it);
+        }
+        ok = ok && !error_check();
+    }
+    return ok;
 }
 
 /* insertion */
@@ -200,7 +270,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
         return ok;
     }
 
-    char *lasts = NULL;
+    const char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
@@ -227,19 +297,27 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    if (current && argc == 3) {
+        if (exception_setup(true))
+            ok = queue_insert_n(pos, need_rand ? NULL : inserts, reps);
+        exception_cancel();
+        q_show(3);
+        return ok;
+    }
+
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                random_strings(randstr_buf, 1, MAX_RANDSTR_LEN,
+                               MIN_RANDSTR_LEN, charset, sizeof(charset) - 1);
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
-                char *cur_inserts = entry->value;
+                q_iter_t it;
+                bool found = pos == POS_TAIL ? q_iter_last(current->q, &it)
+                                             : q_iter_first(current->q, &it);
+                const char *cur_inserts = found ? it.value : NULL;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -249,7 +327,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                            "queue element");
                     ok = false;
                     break;
-                } else if (r == 1 && lasts == cur_inserts) {
+                } else if (!intern && r == 1 && lasts == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate separate string for each "
                            "queue element");
@@ -289,6 +367,214 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Decode \0 into a null byte and \\ into a backslash, in place since the
+ * value only shrinks
+ *
+ * Return: length of the decoded value
+ */
+static size_t unescape_value(char *s)
+{
+    size_t len = 0;
+
+    for (const char *p = s; *p; p++) {
+        if (*p == '\\' && (p[1] == '0' || p[1] == '\\'))
+            s[len++] = *++p == '0' ? '\0' : '\\';
+        else
+            s[len++] = *p;
+    }
+    return len;
+}
+
+/* Insert a value that may hold null bytes, written as \0, through the
+ * length-taking insertion API
+ */
+static bool queue_insert_len(position_t pos, int argc, char *argv[])
+{
+    int reps = 1;
+    bool ok = true;
+
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &reps) || reps < 1)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    char *inserts = argv[1];
+    size_t len = unescape_value(inserts);
+
+    if (!current || !current->q)
+        report(3, "Warning: Calling insert %s on null queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    if (current && exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            bool rval = pos == POS_TAIL
+                            ? q_insert_tail_len(current->q, inserts, len)
+                            : q_insert_head_len(current->q, inserts, len);
+            if (rval) {
+                current->size++;
+                q_iter_t it;
+                bool found = pos == POS_TAIL ? q_iter_last(current->q, &it)
+                                             : q_iter_first(current->q, &it);
+                if (!found || it.len != len || memcmp(it.value, inserts, len) ||
+                    it.value[len]) {
+                    report(1, "ERROR: Stored value differs from the %zu bytes "
+                              "inserted",
+                           len);
+                    ok = false;
+                } else if (it.value == inserts) {
+                    report(1,
+                           "ERROR: Need to allocate and copy string for new "
+                           "queue element");
+                    ok = false;
+                }
+            } else {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", inserts);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           inserts, fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    q_show(3);
+    return ok;
+}
+
+static bool do_ihl(int argc, char *argv[])
+{
+    return queue_insert_len(POS_HEAD, argc, argv);
+}
+
+static bool do_itl(int argc, char *argv[])
+{
+    return queue_insert_len(POS_TAIL, argc, argv);
+}
+
+/* Number of elements removed per call of the bulk removal API */
+#define REMOVE_BATCH 1024
+
+/* Remove reps elements through the bulk removal API, comparing every removed
+ * value to checks unless it is NULL
+ */
+static bool queue_remove_n(position_t pos, const char *checks, int reps)
+{
+    size_t slot = string_length + 1;
+    size_t bufsize = REMOVE_BATCH * slot;
+    char *removes = malloc(bufsize + STRINGPAD + 1);
+    size_t *offsets = malloc(REMOVE_BATCH * sizeof(size_t));
+    if (!removes || !offsets) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        free(removes);
+        free(offsets);
+        return false;
+    }
+
+    /* A null queue fails the removal as a whole, as in queue_remove() */
+    if (!current) {
+        report(3, "Warning: Calling remove %s on null queue",
+               pos == POS_TAIL ? "tail" : "head");
+        free(removes);
+        free(offsets);
+        fail_count++;
+        if (!checks && fail_count < fail_limit) {
+            report(2, "Removal from queue failed");
+            return !error_check();
+        }
+        report(1, "ERROR: Removal from queue failed (%d failures total)",
+               fail_count);
+        return false;
+    }
+
+    if (current->size < reps)
+        report(3, "Warning: Calling remove %s on queue with fewer than %d "
+                  "elements",
+               pos == POS_TAIL ? "tail" : "head", reps);
+    error_check();
+
+    bool ok = true;
+    while (ok && reps > 0) {
+        size_t n = reps < REMOVE_BATCH ? reps : REMOVE_BATCH, got = 0;
+        struct list_head batch;
+        INIT_LIST_HEAD(&batch);
+        memset(removes + bufsize, 'X', STRINGPAD);
+        removes[bufsize + STRINGPAD] = '\0';
+
+        if (exception_setup(true))
+            got = pos == POS_TAIL
+                      ? q_remove_tail_n(current->q, &batch, n, removes,
+                                        bufsize, offsets)
+                      : q_remove_head_n(current->q, &batch, n, removes,
+                                        bufsize, offsets);
+        exception_cancel();
+
+        q_release_list(&batch);
+        current->size -= got;
+        reps -= got;
+
+        /* Padding behind the packed strings must keep its initial 'X' */
+        int i = 0;
+        while (i < STRINGPAD && removes[bufsize + i] == 'X')
+            i++;
+        if (i != STRINGPAD) {
+            report(1,
+                   "ERROR: copying of strings in bulk removal overflowed "
+                   "destination buffer.");
+            ok = false;
+        }
+
+        for (size_t j = 0; ok && j < got; j++) {
+            const char *value = removes + offsets[j];
+            if (offsets[j] >= bufsize) {
+                report(1, "ERROR: Failed to store removed value");
+                ok = false;
+            } else if (checks && strncmp(value, checks, string_length)) {
+                report(1, "ERROR: Removed value %s != expected value %s",
+                       value, checks);
+                ok = false;
+            } else {
+                report(2, "Removed %s from queue", value);
+            }
+        }
+
+        /* Running out of elements, or an engine failing to build one, is
+         * tolerated up to fail_limit as in queue_remove(), and ends the run
+         */
+        if (ok && got < n) {
+            fail_count++;
+            if (!checks && fail_count < fail_limit) {
+                report(2, "Removal from queue failed");
+            } else {
+                report(1,
+                       "ERROR: Removal from queue failed (%d failures total)",
+                       fail_count);
+                ok = false;
+            }
+            ok = ok && !error_check();
+            break;
+        }
+        ok = ok && !error_check();
+    }
+
+    q_show(3);
+
+    free(removes);
+    free(offsets);
+    return ok;
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -313,11 +599,21 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 3) {
+        int reps;
+        if (!get_int(argv[2], &reps) || reps < 1) {
+            report(1, "Invalid number of removals '%s'", argv[2]);
+            return false;
+        }
+        return queue_remove_n(pos, strcmp(argv[1], "*") ? argv[1] : NULL,
+                              reps);
+    }
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -418,6 +714,120 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+/* Insert at tail, handing the queue a harness-allocated copy of the string */
+static bool do_ito(int argc, char *argv[])
+{
+    char randstr_buf[MAX_RANDSTR_LEN];
+    int reps = 1;
+    bool ok = true;
+
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &reps) || reps < 1)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    bool need_rand = !strcmp(argv[1], "RAND");
+    char *inserts = need_rand ? randstr_buf : argv[1];
+
+    if (!current || !current->q)
+        report(3, "Warning: Calling insert tail on null queue");
+    error_check();
+
+    if (current && exception_setup(true)) {
+        for (int r = 0; ok && r < reps; r++) {
+            if (need_rand)
+                random_strings(randstr_buf, 1, MAX_RANDSTR_LEN,
+                               MIN_RANDSTR_LEN, charset, sizeof(charset) - 1);
+            /* The buffer belongs to the queue once inserted, so it has to
+             * come from the harness to be tracked and released there */
+            char *owned = test_strdup(inserts);
+            /* Pool queues copy the string into their arena instead */
+            bool copies = q_backend(current->q) == Q_BACKEND_POOL;
+            if (owned && q_insert_tail_owned(current->q, owned)) {
+                current->size++;
+                q_iter_t it;
+                if (!q_iter_last(current->q, &it) ||
+                    (!copies && it.value != owned)) {
+                    report(1, "ERROR: Owned string was copied rather than "
+                              "adopted");
+                    ok = false;
+                }
+            } else {
+                if (owned)
+                    test_free(owned);
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", inserts);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           inserts, fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    q_show(3);
+    return ok;
+}
+
+/* Pop the head and read its string in place before releasing it */
+static bool do_ph(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->size)
+        report(3, "Warning: Calling pop head on empty queue");
+    error_check();
+
+    element_t *e = NULL;
+    if (current && exception_setup(true))
+        e = q_pop_head(current->q);
+    exception_cancel();
+
+    bool ok = true;
+    if (!e) {
+        fail_count++;
+        if (argc == 1 && fail_count < fail_limit) {
+            report(2, "Pop from queue failed");
+        } else {
+            report(1, "ERROR: Pop from queue failed (%d failures total)",
+                   fail_count);
+            ok = false;
+        }
+    } else {
+        current->size--;
+        if (argc == 2 && strcmp(e->value, argv[1])) {
+            report(1, "ERROR: Popped value %s != expected value %s", e->value,
+                   argv[1]);
+            ok = false;
+        } else {
+            report(2, "Popped %s from queue", e->value);
+        }
+        q_release_element(e);
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Values are compared by length, since they may hold null bytes */
+static inline bool same_value(const char *a, size_t alen, const char *b,
+                              size_t blen)
+{
+    return alen == blen && !memcmp(a, b, alen);
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -432,26 +842,27 @@ static bool do_dedup(int argc, char *argv[])
 
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    q_iter_t it;
 
     // Copy current->q to l_copy
-    if (current->q && !list_empty(current->q)) {
-        list_for_each_entry(item, current->q, list) {
-            size_t slen;
+    bool more = q_iter_first(current->q, &it);
+    if (more) {
+        for (; more; more = q_iter_next(&it)) {
             tmp = malloc(sizeof(element_t));
             if (!tmp)
                 break;
             INIT_LIST_HEAD(&tmp->list);
-            slen = strlen(item->value) + 1;
-            tmp->value = malloc(slen);
+            tmp->value = malloc(it.len + 1);
             if (!tmp->value) {
                 free(tmp);
                 break;
             }
-            memcpy(tmp->value, item->value, slen);
+            memcpy(tmp->value, it.value, it.len + 1);
+            tmp->len = it.len;
             list_add_tail(&tmp->list, &l_copy);
         }
         // Return false if the loop does not leave properly
-        if (&item->list != current->q) {
+        if (more) {
             list_for_each_entry_safe(item, tmp, &l_copy, list) {
                 free(item->value);
                 free(item);
@@ -477,28 +888,27 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    struct list_head *l_tmp = current->q->next;
+    more = q_iter_first(current->q, &it);
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry(item, &l_copy, list) {
         // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
+        const element_t *next = list_entry(item->list.next, element_t, list);
+        bool is_next_dup = item->list.next != &l_copy &&
+                           same_value(next->value, next->len, item->value,
+                                      item->len);
         if (is_this_dup || is_next_dup) {
             // Update list size
             current->size--;
-        } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
-            l_tmp = l_tmp->next;
+        } else if (more &&
+                   same_value(it.value, it.len, item->value, item->len))
+            more = q_iter_next(&it);
         else
             ok = false;
         is_this_dup = is_next_dup;
     }
     // All elements in new list should be traversed
-    ok = ok && l_tmp == current->q;
+    ok = ok && !more;
     if (!ok)
         report(1,
                "ERROR: Duplicate strings are in queue or distinct strings are "
@@ -577,6 +987,41 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Compare the strings at two positions as q_element_cmp() would */
+static int iter_cmp(const q_iter_t *a, const q_iter_t *b)
+{
+    /* Interned strings are equal exactly when they are the same copy */
+    if (a->value == b->value && a->len == b->len)
+        return 0;
+
+    size_t len = a->len < b->len ? a->len : b->len;
+    int cmp = memcmp(a->value, b->value, len);
+    return cmp ? cmp : (a->len > b->len) - (a->len < b->len);
+}
+
+/* Position of an element before sorting, kept in an array sorted by the
+ * identity of the element
+ */
+typedef struct {
+    const void *id;
+    size_t rank;
+} node_rank_t;
+
+static int node_rank_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) ((const node_rank_t *) a)->id;
+    uintptr_t y = (uintptr_t) ((const node_rank_t *) b)->id;
+    return (x > y) - (x < y);
+}
+
+static size_t node_rank(const node_rank_t *ranks, size_t n, const void *id)
+{
+    const node_rank_t key = {.id = id};
+    const node_rank_t *r =
+        bsearch(&key, ranks, n, sizeof(*ranks), node_rank_cmp);
+    return r ? r->rank : SIZE_MAX;
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -597,21 +1042,29 @@ bool do_sort(int argc, char *argv[])
 
     set_noallocate_mode(true);
 
-/* If the number of elements is too large, it may take a long time to check the
- * stability of the sort. So, MAX_NODES is used to limit the number of elements
- * to check the stability of the sort. */
-#define MAX_NODES 100000
-    struct list_head *nodes[MAX_NODES];
-    unsigned no = 0;
-    if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry(entry, current->q, list)
-            nodes[no++] = &entry->list;
-    } else if (current && current->size > MAX_NODES)
-        report(1,
-               "Warning: Skip checking the stability of the sort because the "
-               "number of elements %d is too large, exceeds the limit %d.",
-               current->size, MAX_NODES);
+    /* Record the position of every node before sorting, so that the order of
+     * equal strings can be checked afterwards */
+    node_rank_t *ranks = NULL;
+    size_t nranks = 0;
+    if (current && current->size) {
+        ranks = malloc(current->size * sizeof(*ranks));
+        if (!ranks) {
+            report(1,
+                   "Warning: Skip checking the stability of the sort because "
+                   "space for %d elements could not be allocated.",
+                   current->size);
+        } else {
+            q_iter_t it;
+            bool more = q_iter_first(current->q, &it);
+            for (; more && nranks < (size_t) current->size;
+                 more = q_iter_next(&it)) {
+                ranks[nranks].id = it.id;
+                ranks[nranks].rank = nranks;
+                nranks++;
+            }
+            qsort(ranks, nranks, sizeof(*ranks), node_rank_cmp);
+        }
+    }
 
     if (current && exception_setup(true))
         q_sort(current->q, descend);
@@ -619,50 +1072,37 @@ bool do_sort(int argc, char *argv[])
     set_noallocate_mode(false);
 
     bool ok = true;
-    if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+    q_iter_t item, next_item;
+    if (current && current->size && q_iter_first(current->q, &item)) {
+        for (next_item = item; --cnt && q_iter_next(&next_item);
+             item = next_item) {
             /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            int cmp = iter_cmp(&item, &next_item);
+            if (!descend && cmp > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && cmp < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
             }
             /* Ensure the stability of the sort */
-            if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
-                bool unstable = false;
-                for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
-                        unstable = true;
-                        break;
-                    }
-                    if (nodes[i] == cur_l) {
-                        break;
-                    }
-                }
-                if (unstable) {
-                    report(
-                        1,
-                        "ERROR: Not stable sort. The duplicate strings \"%s\" "
-                        "are not in the same order.",
-                        item->value);
-                    ok = false;
-                    break;
-                }
+            if (ranks && !cmp &&
+                node_rank(ranks, nranks, next_item.id) <
+                    node_rank(ranks, nranks, item.id)) {
+                report(1,
+                       "ERROR: Not stable sort. The duplicate strings \"%s\" "
+                       "are not in the same order.",
+                       item.value);
+                ok = false;
+                break;
             }
         }
     }
-#undef MAX_NODES
+    free(ranks);
 
     q_show(3);
     return ok && !error_check();
@@ -747,13 +1187,11 @@ static bool do_ascend(int argc, char *argv[])
     bool ok = true;
 
     cnt = current->size;
-    if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) > 0) {
+    q_iter_t item, next_item;
+    if (current->size && q_iter_first(current->q, &item)) {
+        for (next_item = item; --cnt && q_iter_next(&next_item);
+             item = next_item) {
+            if (iter_cmp(&item, &next_item) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -794,13 +1232,11 @@ static bool do_descend(int argc, char *argv[])
     bool ok = true;
 
     cnt = current->size;
-    if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) < 0) {
+    q_iter_t item, next_item;
+    if (current->size && q_iter_first(current->q, &item)) {
+        for (next_item = item; --cnt && q_iter_next(&next_item);
+             item = next_item) {
+            if (iter_cmp(&item, &next_item) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -856,14 +1292,24 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
+    /* A first queue kept in an array may have to grow it, and pool queues
+     * build their elements or copy the strings of the others
+     */
+    queue_contex_t *first =
+        list_first_entry(&chain.head, queue_contex_t, chain), *entry;
+    bool noallocate = q_backend(first->q) == Q_BACKEND_LIST;
+    list_for_each_entry (entry, &chain.head, chain) {
+        if (q_backend(entry->q) == Q_BACKEND_POOL)
+            noallocate = false;
+    }
     int len = 0;
-    set_noallocate_mode(true);
+    set_noallocate_mode(noallocate);
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -881,14 +1327,13 @@ static bool do_merge(int argc, char *argv[])
     }
 
     bool ok = true;
-    if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --len; cur_l = cur_l->next) {
+    q_iter_t item, next_item;
+    if (current && current->size && q_iter_first(current->q, &item)) {
+        for (next_item = item; --len && q_iter_next(&next_item);
+             item = next_item) {
             /* Ensure each element in ascending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            int cmp = iter_cmp(&item, &next_item);
+            if (!descend && cmp > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
                        "of unsorted queues are merged or there're some flaws "
@@ -898,7 +1343,7 @@ static bool do_merge(int argc, char *argv[])
             }
 
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && cmp < 0) {
                 report(
                     1,
                     "ERROR: Not sorted in descending order (It might because "
@@ -957,22 +1402,23 @@ static bool q_show(int vlevel)
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    q_iter_t it;
+    bool more = false;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
+        more = q_iter_first(current->q, &it);
+        while (ok && more && cnt < current->size) {
             if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                report_noreturn(vlevel, cnt == 0 ? "%.*s" : " %.*s",
+                                (int) it.len, it.value);
                 if (show_entropy) {
                     report_noreturn(
                         vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
+                        shannon_entropy((const uint8_t *) it.value, it.len));
                 }
             }
             cnt++;
-            cur = cur->next;
+            more = q_iter_next(&it);
             ok = ok && !error_check();
         }
     }
@@ -983,7 +1429,7 @@ static bool q_show(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (!more) {
         if (cnt <= BIG_LIST_SIZE)
             report(vlevel, "]");
         else
@@ -1058,43 +1504,112 @@ static bool do_next(int argc, char *argv[])
 }
 
 
-void q_shuffle(struct list_head *head)
+struct xorshift32_state {
+    uint32_t a;
+};
+static struct xorshift32_state x32_state = {.a = 1};
+
+uint32_t xorshift(void)
 {
-    if (!head || list_empty(head) || list_is_singular(head)) {
+    /* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
+    uint32_t x = x32_state.a;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    // 更新狀態並回傳結果
+    x32_state.a = x;
+    return x;
+}
+
+/* Random number generator driving the shuffle engine */
+typedef uint32_t (*shuffle_rng_t)(void);
+
+static uint32_t rand_u32(void)
+{
+    // rand() may yield as few as 15 bits
+    return (uint32_t) rand() << 16 ^ (uint32_t) rand();
+}
+
+/* Fisher-Yates shuffle in O(n). The nodes are gathered into a scratch array
+ * once, permuted there, and relinked in their new order. The array comes from
+ * the regular allocator, so it does not count against the no-allocate mode of
+ * the harness.
+ */
+static void shuffle_list(struct list_head *head, shuffle_rng_t rng)
+{
+    if (head && q_backend(head) != Q_BACKEND_LIST) {
+        report(1, "Warning: Only queues kept in a list can be shuffled");
         return;
     }
-    int len = q_size(head);
-    if (len < 2) {
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    size_t len = q_size(head), i = 0;
+    struct list_head **nodes = malloc(len * sizeof(*nodes));
+    if (!nodes) {
+        report(1, "ERROR: Could not allocate space for shuffling");
         return;
     }
 
-    struct list_head *tail_node = head->prev;
+    struct list_head *node;
+    list_for_each (node, head)
+        nodes[i++] = node;
 
+    for (i = len - 1; i > 0; i--) {
+        // 以乘法取代取餘數，將 32 位元亂數映射至 [0, i]
+        size_t j = (uint64_t) rng() * (i + 1) >> 32;
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
 
-    for (; len > 1; len--) {
-        int random_idx = rand() % len;
+    INIT_LIST_HEAD(head);
+    for (i = 0; i < len; i++)
+        list_add_tail(nodes[i], head);
+    free(nodes);
+}
 
-        printf("random = %d", random_idx);
-        struct list_head *random_node = head->next;
-        for (int i = 0; i < random_idx; i++) {
-            random_node = random_node->next;
-        }
+void q_shuffle(struct list_head *head)
+{
+    static const shuffle_rng_t rngs[] = {rand_u32, xorshift, random_u32};
 
-        if (random_node != tail_node) {
-            element_t *random_entry = list_entry(random_node, element_t, list);
-            element_t *tail_entry = list_entry(tail_node, element_t, list);
+    int idx = shuffle_rng;
+    if (idx < 0 || idx >= (int) (sizeof(rngs) / sizeof(rngs[0])))
+        idx = 0;
+    shuffle_list(head, rngs[idx]);
+}
 
+static bool do_shuffle(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
 
-            char *temp_val = random_entry->value;
-            random_entry->value = tail_entry->value;
-            tail_entry->value = temp_val;
-        }
+    error_check();
 
+    set_noallocate_mode(true);
 
-        tail_node = tail_node->prev;
+    if (exception_setup(true)) {
+        srand(time(NULL));
+        q_shuffle(current->q);
     }
+
+    exception_cancel();
+    set_noallocate_mode(false);
+    q_show(3);
+
+
+    return !error_check();
 }
-static bool do_shuffle(int argc, char *argv[])
+
+void q_xorshift(struct list_head *head)
+{
+    shuffle_list(head, xorshift);
+}
+
+static bool do_xorshift(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
@@ -1106,91 +1621,501 @@ static bool do_shuffle(int argc, char *argv[])
     set_noallocate_mode(true);
 
     if (exception_setup(true)) {
-        srand(time(NULL));
-        q_shuffle(current->q);
+        q_xorshift(current->q);
     }
 
     exception_cancel();
     set_noallocate_mode(false);
     q_show(3);
 
-
     return !error_check();
 }
 
-struct xorshift32_state {
-    uint32_t a;
-};
-static struct xorshift32_state x32_state = {.a = 1};
+/* Upper bound of the producers and consumers together. In mt_stress each of
+ * them holds a hazard pointer slot of the lock-free queue while it operates.
+ */
+#define STRESS_THREADS_MAX MPMC_THREADS_MAX
 
-uint32_t xorshift(void)
+/* Strings a producer of bq_stress inserts at once */
+#define STRESS_BATCH 16
+
+/* Longest wait of a consumer of bq_stress before checking again */
+#define STRESS_WAIT_NS 1000000
+
+/* Shared state of mt_stress and bq_stress, which go through the lock-free
+ * queue or the blocking one. Element i of producer p is the string "p:i",
+ * whose outcome is tracked at index p * n + i.
+ */
+typedef struct {
+    mpmc_t *q;
+    bqueue_t *bq;
+    int n; /* Elements per producer */
+    atomic_int producing;
+    bool *inserted;     /* Written by the producer of each element only */
+    atomic_uchar *seen; /* Times each element was removed */
+    atomic_long failed, removed, misordered;
+    atomic_long expired; /* Waits of bq_stress that ran out of time */
+} stress_t;
+
+typedef struct {
+    stress_t *s;
+    int id;
+    bool producer;
+    bool started;
+    pthread_t tid;
+} stress_worker_t;
+
+/* Insert the elements of a producer, in batches into a blocking queue, which
+ * the last producer to finish closes
+ */
+static void *stress_produce(stress_worker_t *w)
 {
-    /* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
-    uint32_t x = x32_state.a;
-    x ^= x << 13;
-    x ^= x >> 17;
-    x ^= x << 5;
+    stress_t *s = w->s;
+    char bufs[STRESS_BATCH][32], *strs[STRESS_BATCH];
+
+    for (int i = 0; i < STRESS_BATCH; i++)
+        strs[i] = bufs[i];
+    for (int i = 0; i < s->n;) {
+        int n = 1;
+        if (s->bq)
+            n = s->n - i < STRESS_BATCH ? s->n - i : STRESS_BATCH;
+        for (int j = 0; j < n; j++)
+            snprintf(bufs[j], sizeof(bufs[j]), "%d:%d", w->id, i + j);
+        bool ok = s->bq ? bq_insert_tail_n(s->bq, strs, n)
+                        : mpmc_insert_tail(s->q, bufs[0]);
+        for (int j = 0; j < n; j++)
+            s->inserted[(size_t) w->id * s->n + i + j] = ok;
+        if (!ok)
+            atomic_fetch_add(&s->failed, n);
+        i += n;
+    }
+    if (atomic_fetch_sub(&s->producing, 1) == 1 && s->bq)
+        bq_close(s->bq);
+    return NULL;
+}
 
-    // 更新狀態並回傳結果
-    x32_state.a = x;
-    return x;
+/* Take the next element, NULL once every element is gone. Consumers of the
+ * lock-free queue poll it, those of the blocking queue sleep.
+ */
+static element_t *stress_take(stress_t *s, char *buf, size_t bufsize)
+{
+    for (;;) {
+        if (!s->bq) {
+            bool done = !atomic_load(&s->producing);
+            element_t *e = mpmc_remove_head(s->q, buf, bufsize);
+            if (e || done)
+                return e;
+            sched_yield();
+            continue;
+        }
+
+        element_t *e = bq_remove_head_wait(s->bq, buf, bufsize, STRESS_WAIT_NS);
+        if (e)
+            return e;
+        // 逾時可能與關閉同時發生，關閉後再取一次才能確定已空
+        if (bq_closed(s->bq))
+            return bq_remove_head_wait(s->bq, buf, bufsize, 0);
+        atomic_fetch_add(&s->expired, 1);
+    }
 }
 
-void q_xorshift(struct list_head *head)
+/* Remove elements until every one of them is gone. A single consumer must
+ * see the elements of each producer in the order they were inserted.
+ */
+static void *stress_consume(stress_worker_t *w)
 {
-    // 1. 處理邊界條件：空串列或單一元素不需洗牌
-    if (!head || list_empty(head) || list_is_singular(head)) {
-        return;
+    stress_t *s = w->s;
+    int last[STRESS_THREADS_MAX];
+    char buf[32];
+    long removed = 0;
+
+    for (int p = 0; p < STRESS_THREADS_MAX; p++)
+        last[p] = -1;
+    for (element_t *e; (e = stress_take(s, buf, sizeof(buf)));) {
+        if (s->bq)
+            bq_release_element(e);
+        else
+            mpmc_release_element(e);
+        removed++;
+
+        int p, i;
+        if (sscanf(buf, "%d:%d", &p, &i) != 2 || p < 0 ||
+            p >= STRESS_THREADS_MAX || i < 0 || i >= s->n) {
+            atomic_fetch_add(&s->misordered, 1);
+            continue;
+        }
+        atomic_fetch_add(&s->seen[(size_t) p * s->n + i], 1);
+        if (i <= last[p])
+            atomic_fetch_add(&s->misordered, 1);
+        last[p] = i;
     }
-    int len = q_size(head);
-    if (len < 2) {
-        return;
+    atomic_fetch_add(&s->removed, removed);
+    return NULL;
+}
+
+static void *stress_worker(void *arg)
+{
+    stress_worker_t *w = arg;
+    return w->producer ? stress_produce(w) : stress_consume(w);
+}
+
+/* Body of mt_stress, and of bq_stress when blocking is set */
+static bool run_stress(int argc, char *argv[], bool blocking)
+{
+    int nproducers, nconsumers, n;
+    if (argc != 4 || !get_int(argv[1], &nproducers) ||
+        !get_int(argv[2], &nconsumers) || !get_int(argv[3], &n)) {
+        report(1, "%s takes the numbers of producers, consumers and elements "
+                  "per producer", argv[0]);
+        return false;
+    }
+    if (nproducers < 1 || nconsumers < 1 ||
+        nproducers > STRESS_THREADS_MAX - nconsumers || n < 1 ||
+        n > INT_MAX / nproducers) {
+        report(1, "Producers and consumers must number at least 1 each and "
+                  "at most %d together, and the number of elements positive",
+               STRESS_THREADS_MAX);
+        return false;
+    }
+    error_check();
+
+    size_t total = (size_t) nproducers * n;
+    int nworkers = nproducers + nconsumers;
+    stress_t s = {.n = n};
+    s.inserted = calloc(total, sizeof(bool));
+    s.seen = calloc(total, sizeof(atomic_uchar));
+    stress_worker_t *workers = calloc(nworkers, sizeof(stress_worker_t));
+    bool ok = s.inserted && s.seen && workers;
+    if (!ok) {
+        report(1, "ERROR: Could not allocate space for the stress test");
+        goto out;
+    }
+    /* Creating the queue may fail like any allocation of the queue code */
+    if (blocking)
+        s.bq = bq_new();
+    else
+        s.q = mpmc_new();
+    if (!s.q && !s.bq) {
+        report(3, "Warning: Could not create the concurrent queue");
+        goto out;
+    }
+    atomic_init(&s.producing, nproducers);
+    atomic_init(&s.failed, 0);
+    atomic_init(&s.removed, 0);
+    atomic_init(&s.misordered, 0);
+    atomic_init(&s.expired, 0);
+
+    /* Signals are blocked in the workers, as in the parallel sort, and those
+     * whose thread cannot be created are run by the caller
+     */
+    double time;
+    sigset_t all, old;
+    sigfillset(&all);
+    init_time(&time);
+    clock_t cpu = clock();
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < nworkers; i++) {
+        stress_worker_t *w = &workers[i];
+        w->s = &s;
+        w->producer = i < nproducers;
+        w->id = w->producer ? i : i - nproducers;
+        w->started = !pthread_create(&w->tid, NULL, stress_worker, w);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        if (!workers[i].started)
+            stress_worker(&workers[i]);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].tid, NULL);
+    }
+    double elapsed = delta_time(&time);
+    double cpu_time = (double) (clock() - cpu) / CLOCKS_PER_SEC;
+
+    long lost = 0, duplicated = 0;
+    for (size_t i = 0; i < total; i++) {
+        int seen = atomic_load(&s.seen[i]);
+        if (seen < s.inserted[i])
+            lost++;
+        else if (seen > s.inserted[i])
+            duplicated += seen - s.inserted[i];
+    }
+
+    long inserted = total - atomic_load(&s.failed);
+    long removed = atomic_load(&s.removed);
+    report(1,
+           "%ld elements through %d producers and %d consumers in %.3f s: "
+           "%.0f ops/sec, %.3f s of CPU time",
+           inserted, nproducers, nconsumers, elapsed,
+           elapsed > 0 ? (inserted + removed) / elapsed : 0.0, cpu_time);
+    if (blocking)
+        report(1, "%ld waits of consumers ran out of time",
+               atomic_load(&s.expired));
+    if (lost) {
+        report(1, "ERROR: %ld elements lost", lost);
+        ok = false;
+    }
+    if (duplicated) {
+        report(1, "ERROR: %ld elements removed more than once", duplicated);
+        ok = false;
+    }
+    if (atomic_load(&s.misordered)) {
+        report(1, "ERROR: %ld elements removed out of insertion order",
+               atomic_load(&s.misordered));
+        ok = false;
     }
 
-    struct list_head *tail_node = head->prev;
+out:
+    mpmc_free(s.q);
+    bq_free(s.bq);
+    free(s.inserted);
+    free(s.seen);
+    free(workers);
+    return ok && !error_check();
+}
 
-    for (; len > 1; len--) {
-        int random_idx = xorshift() % len;
+static bool do_mt_stress(int argc, char *argv[])
+{
+    return run_stress(argc, argv, false);
+}
 
-        struct list_head *random_node = head->next;
+static bool do_bq_stress(int argc, char *argv[])
+{
+    return run_stress(argc, argv, true);
+}
 
-        for (int i = 0; i < random_idx; i++) {
-            random_node = random_node->next;
-        }
+/* Monotonic time in nanoseconds */
+static uint64_t now_ns(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t base;
+    if (!base.denom)
+        mach_timebase_info(&base);
+    return mach_absolute_time() * base.numer / base.denom;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
 
-        if (random_node != tail_node) {
-            element_t *random_entry = list_entry(random_node, element_t, list);
-            element_t *tail_entry = list_entry(tail_node, element_t, list);
+/* Bounded list queue guarded by a mutex, the baseline of spsc_bench */
+typedef struct {
+    pthread_mutex_t lock;
+    struct list_head head;
+    size_t size, capacity;
+} locked_list_t;
 
-            char *temp_val = random_entry->value;
-            random_entry->value = tail_entry->value;
-            tail_entry->value = temp_val;
-        }
+static bool locked_push(void *ctx, element_t *e)
+{
+    locked_list_t *l = ctx;
+    bool ok;
 
-        tail_node = tail_node->prev;
+    pthread_mutex_lock(&l->lock);
+    ok = l->size < l->capacity;
+    if (ok) {
+        list_add_tail(&e->list, &l->head);
+        l->size++;
     }
+    pthread_mutex_unlock(&l->lock);
+    return ok;
 }
 
-static bool do_xorshift(int argc, char *argv[])
+static element_t *locked_pop(void *ctx)
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    locked_list_t *l = ctx;
+    element_t *e = NULL;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->size) {
+        e = list_first_entry(&l->head, element_t, list);
+        list_del(&e->list);
+        l->size--;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return e;
+}
+
+static void locked_flush(void *ctx)
+{
+    /* Every element is visible as soon as it is pushed */
+}
+
+static bool ring_push(void *ctx, element_t *e)
+{
+    return spsc_push(ctx, e);
+}
+
+static element_t *ring_pop(void *ctx)
+{
+    return spsc_pop(ctx);
+}
+
+static void ring_flush(void *ctx)
+{
+    spsc_flush(ctx);
+}
+
+/* One run of spsc_bench: the calling thread pushes every element in order and
+ * a consumer thread pops them, each side recording when it got to element i
+ */
+typedef struct {
+    const char *name;
+    void *ctx;
+    bool (*push)(void *ctx, element_t *e);
+    element_t *(*pop)(void *ctx);
+    void (*flush)(void *ctx);
+    element_t **elems;
+    size_t n;
+    uint64_t *sent, *received;
+    size_t misordered;
+} bench_t;
+
+static void *bench_consume(void *arg)
+{
+    bench_t *b = arg;
+
+    for (size_t i = 0; i < b->n; i++) {
+        element_t *e;
+        while (!(e = b->pop(b->ctx)))
+            sched_yield();
+        b->received[i] = now_ns();
+        if (e != b->elems[i])
+            b->misordered++;
+    }
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool bench_run(bench_t *b)
+{
+    pthread_t tid;
+    sigset_t all, old;
+
+    b->misordered = 0;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bool started = !pthread_create(&tid, NULL, bench_consume, b);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) {
+        report(1, "ERROR: Could not start the consumer thread");
         return false;
     }
 
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < b->n; i++) {
+        b->sent[i] = now_ns();
+        while (!b->push(b->ctx, b->elems[i]))
+            sched_yield();
+    }
+    b->flush(b->ctx);
+    pthread_join(tid, NULL);
+    double elapsed = (now_ns() - start) * 1e-9;
+
+    // 延遲改寫進 sent 陣列後排序，以取百分位數
+    for (size_t i = 0; i < b->n; i++)
+        b->sent[i] = b->received[i] - b->sent[i];
+    qsort(b->sent, b->n, sizeof(uint64_t), u64_cmp);
+    uint64_t *lat = b->sent;
+    size_t last = b->n - 1;
+    report(1,
+           "%-6s %.0f elements/sec, latency p50 %" PRIu64 " ns, p90 %" PRIu64
+           " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64
+           " ns",
+           b->name, elapsed > 0 ? b->n / elapsed : 0.0, lat[last / 2],
+           lat[last * 9 / 10], lat[last * 99 / 100], lat[last * 999 / 1000],
+           lat[last]);
+    if (b->misordered) {
+        report(1, "ERROR: %s delivered %zu elements out of order", b->name,
+               b->misordered);
+        return false;
+    }
+    return true;
+}
+
+static bool do_spsc_bench(int argc, char *argv[])
+{
+    int n, capacity = 1024;
+    if ((argc != 2 && argc != 3) || !get_int(argv[1], &n) ||
+        (argc == 3 && !get_int(argv[2], &capacity))) {
+        report(1, "%s takes the number of elements and optionally the "
+                  "capacity of the queues", argv[0]);
+        return false;
+    }
+    if (n < 1 || capacity < 1) {
+        report(1, "The number of elements and the capacity must be positive");
+        return false;
+    }
     error_check();
 
-    set_noallocate_mode(true);
+    /* The elements come from a list queue, so that they are ordinary ones.
+     * Allocating them may fail like any allocation of the queue code.
+     */
+    element_t **elems = calloc(n, sizeof(element_t *));
+    uint64_t *sent = calloc(n, sizeof(uint64_t));
+    uint64_t *received = calloc(n, sizeof(uint64_t));
+    struct list_head *q = q_new();
+    spsc_t *ring = spsc_new(capacity);
+    bool ok = elems && sent && received;
+    size_t built = 0;
+    if (!ok) {
+        report(1, "ERROR: Could not allocate space for the benchmark");
+        goto out;
+    }
+    for (; q && built < (size_t) n && q_insert_tail(q, "spsc"); built++)
+        elems[built] = q_remove_head(q, NULL, 0);
+    if (built < (size_t) n || !ring) {
+        report(3, "Warning: Could not allocate the queue or its elements");
+        goto out;
+    }
+
+    locked_list_t list = {.size = 0, .capacity = capacity};
+    pthread_mutex_init(&list.lock, NULL);
+    INIT_LIST_HEAD(&list.head);
+    bench_t runs[] = {
+        {"spsc", ring, ring_push, ring_pop, ring_flush},
+        {"mutex", &list, locked_push, locked_pop, locked_flush},
+    };
+    report(1, "%d elements through queues of capacity %d", n, capacity);
+    for (size_t i = 0; ok && i < sizeof(runs) / sizeof(runs[0]); i++) {
+        runs[i].elems = elems;
+        runs[i].n = n;
+        runs[i].sent = sent;
+        runs[i].received = received;
+        ok = bench_run(&runs[i]);
+    }
+    pthread_mutex_destroy(&list.lock);
+
+out:
+    spsc_free(ring);
+    q_free(q);
+    for (size_t i = 0; i < built; i++)
+        q_release_element(elems[i]);
+    free(elems);
+    free(sent);
+    free(received);
+    return ok && !error_check();
+}
 
-    if (exception_setup(true)) {
-        q_xorshift(current->q);
-    }
+static void set_sort_threads(int oldval)
+{
+    q_set_sort_threads(sort_threads);
+}
 
-    exception_cancel();
-    set_noallocate_mode(false);
-    q_show(3);
+static void set_intern(int oldval)
+{
+    q_set_intern(intern);
+}
 
-    return !error_check();
+static void set_lazy_reverse(int oldval)
+{
+    q_set_lazy_reverse(lazy_reverse);
 }
 
 static void console_init()
@@ -1207,14 +2132,35 @@ static void console_init()
                 "Insert string str at tail of queue n times. Generate random "
                 "string(s) if str equals RAND. (default: n == 1)",
                 "str [n]");
-    ADD_COMMAND(
-        rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
-    ADD_COMMAND(
-        rt,
-        "Remove from tail of queue. Optionally compare to expected value str",
-        "[str]");
+    ADD_COMMAND(rh,
+                "Remove from head of queue n times. Optionally compare to "
+                "expected value str, where * matches any value. (default: "
+                "n == 1)",
+                "[str [n]]");
+    ADD_COMMAND(rt,
+                "Remove from tail of queue n times. Optionally compare to "
+                "expected value str, where * matches any value. (default: "
+                "n == 1)",
+                "[str [n]]");
+    ADD_COMMAND(ihl,
+                "Insert string str, which may hold null bytes written as \\0, "
+                "at head of queue n times, passing its length. (default: "
+                "n == 1)",
+                "str [n]");
+    ADD_COMMAND(itl,
+                "Insert string str, which may hold null bytes written as \\0, "
+                "at tail of queue n times, passing its length. (default: "
+                "n == 1)",
+                "str [n]");
+    ADD_COMMAND(ito,
+                "Insert string str at tail of queue n times, handing over a "
+                "harness-allocated copy instead of having it copied. Generate "
+                "random string(s) if str equals RAND. (default: n == 1)",
+                "str [n]");
+    ADD_COMMAND(ph,
+                "Pop from head of queue and read the value in place. "
+                "Optionally compare to expected value str",
+                "[str]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descending order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
@@ -1235,6 +2181,18 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(mt_stress,
+                "Push n elements from each of p producer threads through a "
+                "lock-free queue to c consumer threads",
+                "p c n");
+    ADD_COMMAND(bq_stress,
+                "Push n elements from each of p producer threads through a "
+                "blocking queue to c consumer threads",
+                "p c n");
+    ADD_COMMAND(spsc_bench,
+                "Compare a single-producer single-consumer ring with a "
+                "mutex-protected list, passing n elements between two threads",
+                "n [capacity]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1243,6 +2201,20 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("shuffle_rng", &shuffle_rng,
+              "Generator of shuffle: 0 = rand, 1 = xorshift, 2 = CSPRNG", NULL);
+    add_param("intern", &intern,
+              "Share one copy of each distinct string among queue elements",
+              set_intern);
+    add_param("lazy_reverse", &lazy_reverse,
+              "Reverse queues by flipping their direction in constant time",
+              set_lazy_reverse);
+    add_param("backend", &backend,
+              "Storage engine of new queues: 0 = list, 1 = ring, 2 = unrolled, "
+              "3 = pool",
+              NULL);
+    add_param("sort_threads", &sort_threads,
+              "Number of threads used to sort large queues", set_sort_threads);
 }
 
 /* Signal handlers */
@@ -1275,8 +2247,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1290,7 +2260,7 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+    q_shrink_cache();
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1,16 +1,460 @@
 #include "queue.h"
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "queue_backend.h"
+
 int q_merge(struct list_head *head, bool descend);
+
+/* Element slab cache
+ *
+ * Each element is a single object holding the element_t followed by its
+ * string.  Objects are carved out of slabs, one slab cache per 16-byte size
+ * class, rather than being malloc'ed one at a time.  Every object is preceded
+ * by a pointer to its slab, so q_release_element() can recycle it without
+ * knowing which queue it belonged to.  Slabs themselves come from malloc(),
+ * hence the allocation failure injection and leak accounting of the harness
+ * still apply, at slab granularity.  Objects too large for any size class are
+ * malloc'ed individually and carry a NULL slab pointer.
+ */
+#define SLAB_BYTES 8192
+#define SLAB_CLASS_SHIFT 4
+#define SLAB_CLASSES 16
+#define SLAB_MAX_OBJ (SLAB_CLASSES << SLAB_CLASS_SHIFT)
+
+struct slab_cache;
+
+typedef struct {
+    struct list_head link;    /* Node in cache->partial while not full */
+    struct slab_cache *cache; /* Size class this slab belongs to */
+    void *freelist;           /* Released objects, linked through first word */
+    unsigned int inuse;       /* Number of objects handed out */
+    unsigned int carved;      /* Number of objects ever handed out */
+    unsigned char objs[];
+} slab_t;
+
+typedef struct slab_cache {
+    struct list_head partial; /* Slabs with at least one free object */
+    /* One empty slab kept back, so that a queue hovering around a slab
+     * boundary does not malloc and free a whole slab on every insert and
+     * remove.
+     */
+    slab_t *spare;
+} slab_cache_t;
+
+static slab_cache_t slab_caches[SLAB_CLASSES];
+
+pthread_mutex_t element_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Slab pointer stored in front of element e */
+static inline slab_t **element_slab(element_t *e)
+{
+    return (slab_t **) e - 1;
+}
+
+static inline size_t cache_objsize(const slab_cache_t *cache)
+{
+    return (size_t) (cache - slab_caches + 1) << SLAB_CLASS_SHIFT;
+}
+
+/* Allocate an element followed by data_size bytes for its string */
+static element_t *element_alloc(size_t data_size)
+{
+    size_t size = sizeof(slab_t *) + sizeof(element_t) + data_size;
+    if (size > SLAB_MAX_OBJ) {
+        slab_t **obj = malloc(size);
+        if (!obj)
+            return NULL;
+        *obj = NULL;
+        return (element_t *) (obj + 1);
+    }
+
+    slab_cache_t *cache = &slab_caches[(size - 1) >> SLAB_CLASS_SHIFT];
+    size_t objsize = cache_objsize(cache);
+    if (!cache->partial.next)
+        INIT_LIST_HEAD(&cache->partial);
+    if (list_empty(&cache->partial)) {
+        slab_t *slab = cache->spare;
+        cache->spare = NULL;
+        if (!slab) {
+            slab = malloc(sizeof(slab_t) + SLAB_BYTES);
+            if (!slab)
+                return NULL;
+            slab->cache = cache;
+            slab->freelist = NULL;
+            slab->inuse = slab->carved = 0;
+        }
+        list_add(&slab->link, &cache->partial);
+    }
+
+    slab_t *slab = list_first_entry(&cache->partial, slab_t, link);
+    slab_t **obj;
+    if (slab->freelist) {
+        obj = slab->freelist;
+        slab->freelist = *(void **) obj;
+    } else {
+        obj = (slab_t **) (slab->objs + slab->carved++ * objsize);
+    }
+    *obj = slab;
+
+    if (++slab->inuse == SLAB_BYTES / objsize)
+        list_del(&slab->link);
+    return (element_t *) (obj + 1);
+}
+
+/* String interning
+ *
+ * In interning mode, element_new() does not copy the string into the element
+ * but looks it up in a hash-consed table, so that every element holding the
+ * same bytes points at a single reference-counted copy.  Entries go away with
+ * their last reference, and the bucket array with the last entry, so the
+ * table holds no memory once every queue has been freed.
+ */
+#define INTERN_MIN_BUCKETS 256
+
+typedef struct intern_entry {
+    struct intern_entry *next; /* Next entry in the same bucket */
+    uint64_t hash;
+    size_t refcnt;
+    size_t len;
+    char str[];
+} intern_entry_t;
+
+static struct {
+    intern_entry_t **buckets;
+    size_t mask; /* Number of buckets minus one */
+    size_t count;
+} intern_table;
+
+static bool intern_mode = false;
+
+void q_set_intern(bool enable)
+{
+    intern_mode = enable;
+}
+
+/* FNV-1a */
+static uint64_t intern_hash(const char *s, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Double the bucket array once there are as many entries as buckets. Failing
+ * to grow only makes the chains longer.
+ */
+static void intern_grow(void)
+{
+    size_t nbuckets = intern_table.buckets ? (intern_table.mask + 1) * 2
+                                           : INTERN_MIN_BUCKETS;
+    intern_entry_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets)
+        return;
+
+    for (size_t i = 0; intern_table.buckets && i <= intern_table.mask; i++) {
+        intern_entry_t *entry, *next;
+        for (entry = intern_table.buckets[i]; entry; entry = next) {
+            next = entry->next;
+            size_t b = entry->hash & (nbuckets - 1);
+            entry->next = buckets[b];
+            buckets[b] = entry;
+        }
+    }
+    free(intern_table.buckets);
+    intern_table.buckets = buckets;
+    intern_table.mask = nbuckets - 1;
+}
+
+/* Return a reference to the interned copy of the len bytes at s */
+static const char *intern_get(const char *s, size_t len)
+{
+    uint64_t hash = intern_hash(s, len);
+
+    if (intern_table.buckets) {
+        intern_entry_t *entry = intern_table.buckets[hash & intern_table.mask];
+        for (; entry; entry = entry->next) {
+            if (entry->hash == hash && entry->len == len &&
+                !memcmp(entry->str, s, len)) {
+                entry->refcnt++;
+                return entry->str;
+            }
+        }
+    }
+
+    intern_entry_t *entry = malloc(sizeof(intern_entry_t) + len + 1);
+    if (!entry)
+        return NULL;
+
+    if (!intern_table.buckets || intern_table.count > intern_table.mask)
+        intern_grow();
+    if (!intern_table.buckets) {
+        free(entry);
+        return NULL;
+    }
+
+    memcpy(entry->str, s, len);
+    entry->str[len] = '\0';
+    entry->hash = hash;
+    entry->refcnt = 1;
+    entry->len = len;
+
+    intern_entry_t **bucket = &intern_table.buckets[hash & intern_table.mask];
+    entry->next = *bucket;
+    *bucket = entry;
+    intern_table.count++;
+    return entry->str;
+}
+
+/* Drop a reference to value if it is interned. Return whether it was. */
+static bool intern_put(const char *value, size_t len)
+{
+    if (!intern_table.count)
+        return false;
+
+    uint64_t hash = intern_hash(value, len);
+    intern_entry_t **link = &intern_table.buckets[hash & intern_table.mask];
+    for (; *link; link = &(*link)->next) {
+        intern_entry_t *entry = *link;
+        if (entry->str != value)
+            continue;
+        if (--entry->refcnt)
+            return true;
+
+        *link = entry->next;
+        free(entry);
+        if (!--intern_table.count) {
+            free(intern_table.buckets);
+            intern_table.buckets = NULL;
+        }
+        return true;
+    }
+    return false;
+}
+
+void element_free(element_t *e)
+{
+    // 字串若不在節點內，則為共用的 intern 字串或採用的外部字串
+    if (e->value != e->data && !intern_put(e->value, e->len))
+        free(e->value);
+
+    slab_t **obj = element_slab(e);
+    slab_t *slab = *obj;
+    if (!slab) {
+        free(obj);
+        return;
+    }
+
+    slab_cache_t *cache = slab->cache;
+    *(void **) obj = slab->freelist;
+    slab->freelist = obj;
+    if (slab->inuse-- == SLAB_BYTES / cache_objsize(cache))
+        list_add(&slab->link, &cache->partial);
+    if (slab->inuse)
+        return;
+
+    list_del(&slab->link);
+    if (cache->spare)
+        free(slab);
+    else
+        cache->spare = slab;
+}
+
+/* Allocate an element holding a copy of the len bytes at s, or a reference to
+ * its interned copy in interning mode
+ */
+element_t *element_new(const char *s, size_t len)
+{
+    element_t *e = element_alloc(intern_mode ? 0 : len + 1);
+    if (!e)
+        return NULL;
+    if (intern_mode) {
+        e->value = (char *) intern_get(s, len);
+        if (!e->value) {
+            e->value = e->data;
+            element_free(e);
+            return NULL;
+        }
+    } else {
+        e->value = memcpy(e->data, s, len);
+        e->value[len] = '\0';
+    }
+    e->len = len;
+    e->key = q_key_prefix(s, len);
+    return e;
+}
+
+/* Allocate an element taking over s, which was allocated with malloc() */
+element_t *element_adopt(char *s)
+{
+    element_t *e = element_alloc(0);
+    if (!e)
+        return NULL;
+    e->value = s;
+    e->len = strlen(s);
+    e->key = q_key_prefix(s, e->len);
+    return e;
+}
+
+/* Release the element along with the string stored inside it */
+void q_release_element(element_t *e)
+{
+    element_free(e);
+}
+
+/* Give the spare slabs back to the allocator */
+void q_shrink_cache(void)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        free(slab_caches[i].spare);
+        slab_caches[i].spare = NULL;
+    }
+}
+
+/* Reverse a circular list in place by swapping the links of every node */
+static inline void reverse_list(struct list_head *head)
+{
+    struct list_head *node = head, *next;
+
+    do {
+        next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != head);
+}
+
+static bool lazy_reverse = false;
+
+void q_set_lazy_reverse(bool enable)
+{
+    lazy_reverse = enable;
+}
+
+/* Carry out a pending lazy reversal on the links, for operations that walk
+ * the list in order
+ */
+static void materialize(struct list_head *head)
+{
+    queue_t *q = q_header(head);
+    if (q->reversed) {
+        reverse_list(head);
+        q->reversed = false;
+    }
+}
+
+/* Link node at the logical head or tail of the queue */
+static inline void link_node(struct list_head *node,
+                             struct list_head *head,
+                             bool tail)
+{
+    if (tail != q_header(head)->reversed)
+        list_add_tail(node, head);
+    else
+        list_add(node, head);
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (head)
-        INIT_LIST_HEAD(head);
-    return head;
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->reversed = false;
+    q->ops = NULL;
+    return &q->head;
+}
+
+/* Storage engines other than the list, indexed by q_backend_t */
+static const struct queue_ops *const backends[] = {
+    [Q_BACKEND_RING] = &ring_ops,
+    [Q_BACKEND_UNROLLED] = &unrolled_ops,
+    [Q_BACKEND_POOL] = &pool_ops,
+};
+
+/* Create an empty queue kept by the given storage engine */
+struct list_head *q_new_backend(q_backend_t backend)
+{
+    if (backend == Q_BACKEND_LIST)
+        return q_new();
+    if ((size_t) backend >= sizeof(backends) / sizeof(backends[0]) ||
+        !backends[backend])
+        return NULL;
+
+    queue_t *q = backends[backend]->create();
+    return q ? &q->head : NULL;
+}
+
+q_backend_t q_backend(struct list_head *head)
+{
+    const struct queue_ops *ops = head ? q_header(head)->ops : NULL;
+    return ops ? ops->backend : Q_BACKEND_LIST;
+}
+
+/* Fill in the element of the iterator */
+static inline bool iter_set(q_iter_t *it, const element_t *e)
+{
+    it->value = e->value;
+    it->len = e->len;
+    it->id = e;
+    return true;
+}
+
+static bool iter_end(struct list_head *head, q_iter_t *it, bool last)
+{
+    if (!head || !it)
+        return false;
+    it->q = q_header(head);
+    if (it->q->ops)
+        return it->q->size && it->q->ops->iter_end(it, last);
+
+    struct list_head *node = last ? q_last_node(head) : q_first_node(head);
+    if (node == head)
+        return false;
+    it->pos = node;
+    return iter_set(it, list_entry(node, element_t, list));
+}
+
+static bool iter_step(q_iter_t *it, bool back)
+{
+    if (it->q->ops)
+        return it->q->ops->iter_step(it, back);
+
+    struct list_head *head = &it->q->head;
+    struct list_head *node = back ? q_prev_node(head, it->pos)
+                                  : q_next_node(head, it->pos);
+    if (node == head)
+        return false;
+    it->pos = node;
+    return iter_set(it, list_entry(node, element_t, list));
+}
+
+bool q_iter_first(struct list_head *head, q_iter_t *it)
+{
+    return iter_end(head, it, false);
+}
+
+bool q_iter_last(struct list_head *head, q_iter_t *it)
+{
+    return iter_end(head, it, true);
+}
+
+bool q_iter_next(q_iter_t *it)
+{
+    return iter_step(it, false);
+}
+
+bool q_iter_prev(q_iter_t *it)
+{
+    return iter_step(it, true);
 }
 
 /* Free all storage used by queue */
@@ -18,11 +462,15 @@ void q_free(struct list_head *l)
 {
     if (!l)
         return;
+    if (q_header(l)->ops) {
+        q_header(l)->ops->destroy(q_header(l));
+        return;
+    }
     element_t *entry, *safe = NULL;
 
     list_for_each_entry_safe (entry, safe, l, list)
         q_release_element(entry);
-    free(l);
+    free(q_header(l));
 }
 
 /* Insert an element at head of queue */
@@ -31,63 +479,201 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head || !s)  // 確保 head 和 s 不是 NULL
         return false;
 
-    element_t *new_element = malloc(sizeof(element_t));
-    if (!new_element)  // 檢查 malloc 是否成功
+    return q_insert_head_len(head, s, strlen(s));
+}
+
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head || !s)  // 確保 head 和 s 不是 NULL
+        return false;
+
+    return q_insert_tail_len(head, s, strlen(s));
+}
+
+/* Insert an element holding len bytes at head of queue */
+bool q_insert_head_len(struct list_head *head, const char *s, size_t len)
+{
+    if (!head || !s)
         return false;
+    if (q_header(head)->ops)
+        return q_header(head)->ops->insert(q_header(head), s, len, false);
 
-    new_element->value = strdup(s);  // 分配記憶體並複製字串
-    if (!new_element->value) {
-        free(new_element);
+    element_t *new_element = element_new(s, len);  // 一次配置節點與字串
+    if (!new_element)  // 檢查配置是否成功
         return false;
-    }
 
-    list_add(&new_element->list, head);  // 插入節點
+    link_node(&new_element->list, head, false);  // 插入節點
+    q_header(head)->size++;
 
     return true;
 }
 
+/* Insert an element holding len bytes at tail of queue */
+bool q_insert_tail_len(struct list_head *head, const char *s, size_t len)
+{
+    if (!head || !s)
+        return false;
+    if (q_header(head)->ops)
+        return q_header(head)->ops->insert(q_header(head), s, len, true);
 
-/* Insert an element at tail of queue */
-bool q_insert_tail(struct list_head *head, char *s)
+    element_t *new_element = element_new(s, len);  // 一次配置節點與字串
+    if (!new_element)  // 檢查配置是否成功
+        return false;
+
+    link_node(&new_element->list, head, true);  // 插入節點
+    q_header(head)->size++;
+
+    return true;
+}
+
+/* Insert an element adopting s at tail of queue */
+bool q_insert_tail_owned(struct list_head *head, char *s)
 {
-    if (!head || !s)  // 確保 head 和 s 不是 NULL
+    if (!head || !s)
         return false;
+    if (q_header(head)->ops)
+        return q_header(head)->ops->insert_owned(q_header(head), s);
 
-    element_t *new_element = malloc(sizeof(element_t));
-    if (!new_element)  // 檢查 malloc 是否成功
+    element_t *e = element_adopt(s);
+    if (!e)
         return false;
 
-    new_element->value = strdup(s);  // 分配記憶體並複製字串
-    if (!new_element->value) {
-        free(new_element);
+    link_node(&e->list, head, true);
+    q_header(head)->size++;
+    return true;
+}
+
+/* Build a detached list of elements holding copies of the n strings, each one
+ * added at the front when reverse is set, as repeated head insertions would
+ * leave them. Nothing is left allocated on failure.
+ */
+static bool element_new_n(struct list_head *batch,
+                          char **strs,
+                          size_t n,
+                          bool reverse)
+{
+    INIT_LIST_HEAD(batch);
+    for (size_t i = 0; i < n; i++) {
+        element_t *e = strs[i] ? element_new(strs[i], strlen(strs[i])) : NULL;
+        if (!e) {
+            element_t *entry, *safe;
+            list_for_each_entry_safe (entry, safe, batch, list)
+                element_free(entry);
+            return false;
+        }
+        if (reverse)
+            list_add(&e->list, batch);
+        else
+            list_add_tail(&e->list, batch);
+    }
+    return true;
+}
+
+/* Delete the element at either end of a queue of another storage engine */
+static void engine_drop(queue_t *q, bool tail)
+{
+    if (q->ops->drop)
+        q->ops->drop(q, tail);
+    else
+        element_free(q->ops->remove(q, tail));
+}
+
+/* Insert n elements one at a time into a queue of another storage engine,
+ * taking them back out if one of them cannot be inserted
+ */
+static bool engine_insert_n(queue_t *q, char **strs, size_t n, bool tail)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (strs[i] && q->ops->insert(q, strs[i], strlen(strs[i]), tail))
+            continue;
+        while (i--)
+            engine_drop(q, tail);
         return false;
     }
+    return true;
+}
 
-    list_add_tail(&new_element->list, head);  // 插入節點
+/* Insert n elements at either end of the queue, all or none. The batch is
+ * built in the physical order it takes in the list.
+ */
+static bool insert_n(struct list_head *head, char **strs, size_t n, bool tail)
+{
+    struct list_head batch;
+
+    if (!head || (n && !strs))
+        return false;
+    if (q_header(head)->ops)
+        return engine_insert_n(q_header(head), strs, n, tail);
+
+    bool at_back = tail != q_header(head)->reversed;
+    if (!element_new_n(&batch, strs, n, !at_back))
+        return false;
 
+    if (at_back)
+        list_splice_tail(&batch, head);
+    else
+        list_splice(&batch, head);
+    q_header(head)->size += n;
     return true;
 }
 
-/* Remove an element from head of queue */
-element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+/* Insert n elements at head of queue, all or none */
+bool q_insert_head_n(struct list_head *head, char **strs, size_t n)
 {
-    if (!head || list_empty(head))
-        return NULL;
+    return insert_n(head, strs, n, false);
+}
 
+/* Insert n elements at tail of queue, all or none */
+bool q_insert_tail_n(struct list_head *head, char **strs, size_t n)
+{
+    return insert_n(head, strs, n, true);
+}
 
-    element_t *elem = list_first_entry(head, element_t, list);
+/* Remove the element from head of queue without copying its string */
+element_t *q_pop_head(struct list_head *head)
+{
+    return q_remove_head(head, NULL, 0);
+}
+
+/* Copy the value of elem to sp, truncated to bufsize - 1 bytes. Unlike
+ * strncpy(), nothing is written past the terminator.
+ */
+static inline void copy_value(const element_t *elem, char *sp, size_t bufsize)
+{
+    size_t len = elem->len < bufsize - 1 ? elem->len : bufsize - 1;
+    memcpy(sp, elem->value, len);
+    sp[len] = '\0';
+}
 
+/* Unlink the element at the logical head or tail of a non-empty queue. NULL if
+ * the storage engine fails to build an element for it.
+ */
+static inline element_t *unlink_end(struct list_head *head, bool tail)
+{
+    queue_t *q = q_header(head);
+    if (q->ops)
+        return q->ops->remove(q, tail);
 
+    element_t *elem = list_entry(tail ? q_last_node(head) : q_first_node(head),
+                                 element_t, list);
     list_del(&elem->list);
+    q->size--;
+    return elem;
+}
 
-    if (sp && bufsize > 0) {
-        sp[0] = '\0';
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !q_header(head)->size)
+        return NULL;
 
-        if (elem->value) {
-            strncpy(sp, elem->value, bufsize - 1);
-            sp[bufsize - 1] = '\0';
-        }
-    }
+
+    element_t *elem = unlink_end(head, false);
+
+    if (elem && sp && bufsize > 0)
+        copy_value(elem, sp, bufsize);
 
     return elem;
 }
@@ -97,30 +683,140 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 /* Remove an element from tail of queue */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
         return NULL;
 
 
-    element_t *elem = list_last_entry(head, element_t, list);
+    element_t *elem = unlink_end(head, true);
 
+    if (elem && sp && bufsize > 0)
+        copy_value(elem, sp, bufsize);
+
+    return elem;
+}
 
-    list_del(&elem->list);
 
-    if (sp && bufsize > 0) {
-        // 先將緩衝區置空，避免後面狀況導致舊資料殘留
-        sp[0] = '\0';
 
-        // 若 elem->value 不為 NULL，就做字串拷貝
-        if (elem->value) {
-            strncpy(sp, elem->value, bufsize - 1);
-            sp[bufsize - 1] = '\0';  // 確保結尾有 '\0'
+/* Copy the string of e to offset *pos of the packed buffer. A string that does
+ * not fit is truncated, and once the buffer is full the remaining strings all
+ * share its final null terminator.
+ */
+static size_t pack_value(const element_t *e,
+                         char *buf,
+                         size_t bufsize,
+                         size_t *pos)
+{
+    size_t offset = *pos, room = bufsize - offset;
+    size_t len = e->len;
+
+    if (len >= room)
+        len = room - 1;
+    memcpy(buf + offset, e->value, len);
+    buf[offset + len] = '\0';
+    *pos = offset + len + 1 < bufsize ? offset + len + 1 : bufsize - 1;
+    return offset;
+}
+
+/* Detach up to n elements from either end of the queue with a single cut */
+static size_t remove_n(struct list_head *head,
+                       struct list_head *out,
+                       size_t n,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets,
+                       bool tail)
+{
+    if (!out)
+        return 0;
+    INIT_LIST_HEAD(out);
+    if (!head || !q_header(head)->size || !n)
+        return 0;
+
+    queue_t *q = q_header(head);
+    if (n > (size_t) q->size)
+        n = q->size;
+
+    size_t pos = 0;
+    if (q->ops) {
+        // 其他儲存引擎逐一移除，並依佇列順序串到 out
+        for (size_t i = 0; i < n; i++) {
+            element_t *e = q->ops->remove(q, tail);
+            if (!e)
+                return i;
+            if (tail)
+                list_add(&e->list, out);
+            else
+                list_add_tail(&e->list, out);
+            if (!buf || !bufsize)
+                continue;
+            size_t offset = pack_value(e, buf, bufsize, &pos);
+            if (offsets)
+                offsets[i] = offset;
         }
+        return n;
     }
 
-    return elem;
+    tail = tail != q->reversed;
+    struct list_head *node = head;
+    for (size_t i = 0; i < n; i++) {
+        node = tail ? node->prev : node->next;
+        if (!buf || !bufsize)
+            continue;
+        size_t offset =
+            pack_value(list_entry(node, element_t, list), buf, bufsize, &pos);
+        if (offsets)
+            offsets[i] = offset;
+    }
+
+    if (tail) {
+        // 先切下前段，剩下的尾段整段移至 out，再把前段接回
+        struct list_head front;
+        INIT_LIST_HEAD(&front);
+        list_cut_position(&front, head, node->prev);
+        list_splice_init(head, out);
+        list_splice(&front, head);
+    } else {
+        list_cut_position(out, head, node);
+    }
+    if (q->reversed)
+        reverse_list(out);
+    q->size -= n;
+    return n;
+}
+
+/* Remove up to n elements from head of queue */
+size_t q_remove_head_n(struct list_head *head,
+                       struct list_head *out,
+                       size_t n,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets)
+{
+    return remove_n(head, out, n, buf, bufsize, offsets, false);
+}
+
+/* Remove up to n elements from tail of queue */
+size_t q_remove_tail_n(struct list_head *head,
+                       struct list_head *out,
+                       size_t n,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets)
+{
+    return remove_n(head, out, n, buf, bufsize, offsets, true);
 }
 
+/* Release every element of a list detached from a queue */
+void q_release_list(struct list_head *list)
+{
+    element_t *entry, *safe;
 
+    if (!list)
+        return;
+    list_for_each_entry_safe (entry, safe, list, list)
+        element_free(entry);
+    INIT_LIST_HEAD(list);
+}
 
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
@@ -128,46 +824,48 @@ int q_size(struct list_head *head)
     if (!head)
         return 0;
 
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        len++;
-    return len;
+    return q_header(head)->size;
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
-    if (!head)
-        return NULL;
-    if (list_is_singular(head)) {
-        list_del(head);
+    if (!head || !q_header(head)->size)
+        return false;
+
+    // 元素個數已知，從較近的一端走到第 ⌊n / 2⌋ 個節點
+    queue_t *q = q_header(head);
+    if (q->ops) {
+        q->ops->delete_mid(q);
         return true;
     }
-
-    struct list_head *cur = NULL;
-    struct list_head *tmp = NULL;
-    int mid = 0, current = -1;
-    cur = head;
-    mid = q_size(head) / 2;
-    while (cur != NULL && current != mid) {
-        tmp = cur;
-        cur = cur->next;
-
-        current++;
+    int mid = q->reversed ? (q->size - 1) / 2 : q->size / 2;
+    struct list_head *cur;
+    if (mid < q->size - mid) {
+        cur = head->next;
+        for (int i = 0; i < mid; i++)
+            cur = cur->next;
+    } else {
+        cur = head->prev;
+        for (int i = q->size - 1; i > mid; i--)
+            cur = cur->prev;
     }
-    element_t *del_element = list_entry(cur, element_t, list);  // O(1) 取得尾部
-    tmp->next = cur->next;
-    q_release_element(del_element);
+
+    list_del(cur);
+    q->size--;
+    q_release_element(list_entry(cur, element_t, list));
     return true;
 }
 
 /* Delete all nodes that have duplicate string */
 bool q_delete_dup(struct list_head *head)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || q_header(head)->size < 2)
         return false;
+    if (q_header(head)->ops) {
+        q_header(head)->ops->delete_dup(q_header(head));
+        return true;
+    }
 
     struct list_head *cur = head->next;
 
@@ -180,11 +878,12 @@ bool q_delete_dup(struct list_head *head)
         // 檢查後面是否有相同的數據
         while (next != head) {
             element_t *elem2 = list_entry(next, element_t, list);
-            if (strcmp(elem1->value, elem2->value) == 0) {
+            if (q_element_cmp(elem1, elem2) == 0) {
                 struct list_head *dup = next;
                 next = next->next;
                 list_del(dup);
                 q_release_element(elem2);
+                q_header(head)->size--;
                 has_duplicate = true;
             } else
                 break;
@@ -197,6 +896,7 @@ bool q_delete_dup(struct list_head *head)
         if (has_duplicate) {
             list_del(temp);
             q_release_element(elem1);
+            q_header(head)->size--;
         }
     }
 
@@ -208,178 +908,446 @@ bool q_delete_dup(struct list_head *head)
 /* Swap every two adjacent nodes */
 void q_swap(struct list_head *head)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || q_header(head)->size < 2)
+        return;
+    if (q_header(head)->ops) {
+        q_header(head)->ops->swap(q_header(head));
         return;
-
-    struct list_head *cur = head->next;
-
-    while (cur != head && cur->next != head) {
-        struct list_head *next = cur->next;
-
-        // 取得 element_t 結構體
-        element_t *elem1 = list_entry(cur, element_t, list);
-        element_t *elem2 = list_entry(next, element_t, list);
-
-        // 交換 `value`（這裡只交換指標，因為 `value` 是字串）
-        char *temp = elem1->value;
-        elem1->value = elem2->value;
-        elem2->value = temp;
-
-        // 移動 cur 到下一對
-        cur = next->next;
     }
-}
 
+    materialize(head);
+    // 字串存放在節點內，因此移動節點而非交換 `value`
+    struct list_head *cur;
+    for (cur = head->next; cur != head && cur->next != head; cur = cur->next)
+        list_move(cur, cur->next);
+}
 
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || q_header(head)->size < 2)
         return;
 
-    struct list_head *cur = head->next, *last = head->prev;
-
-    while (cur != last && last->next != cur) {
-        element_t *elem1 = list_entry(cur, element_t, list);
-        element_t *elem2 = list_entry(last, element_t, list);
-
-        // 交換 `value`
-        char *temp = elem1->value;
-        elem1->value = elem2->value;
-        elem2->value = temp;
-
-        cur = cur->next;
-        last = last->prev;
-    }
+    if (q_header(head)->ops)
+        q_header(head)->ops->reverse(q_header(head));
+    else if (lazy_reverse)
+        q_header(head)->reversed = !q_header(head)->reversed;
+    else
+        reverse_list(head);
 }
 
 
 /* Reverse the nodes of the list k at a time */
 void q_reverseK(struct list_head *head, int k)
 {
-    if (!head || list_empty(head) || list_is_singular(head) || k == 1)
+    if (!head || q_header(head)->size < 2 || k <= 1)
         return;
+    if (q_header(head)->ops) {
+        q_header(head)->ops->reverseK(q_header(head), k);
+        return;
+    }
 
-    struct list_head *cur = head->next;
-    while (cur != head) {
-        struct list_head *start = cur, *end = cur;
-        int count = 1;
+    materialize(head);
+    struct list_head *anchor = head;
+    while (anchor->next != head) {
+        struct list_head *first = anchor->next, *last = anchor;
+        int count = 0;
 
         // 找到 k 個節點
-        while (count < k && end->next != head) {
-            end = end->next;
+        while (count < k && last->next != head) {
+            last = last->next;
             count++;
         }
 
         if (count < k)  // 剩餘節點不足 k 個，停止
             break;
 
-        struct list_head *left = start, *right = end;
-        while (left != right && right->next != left) {
-            element_t *elem1 = list_entry(left, element_t, list);
-            element_t *elem2 = list_entry(right, element_t, list);
+        // 切下這一組，反轉後接回原位
+        LIST_HEAD(group);
+        list_cut_position(&group, anchor, last);
+        reverse_list(&group);
+        list_splice(&group, anchor);
+
+        anchor = first;  // 移動到下一組
+    }
+}
+
+/* Number of pending run slots in q_sort(); slot i holds the merge of 2^i
+ * natural runs, so 64 slots cover any list that fits in memory.
+ */
+#define SORT_RUN_SLOTS 64
+
+/* Compare two nodes in the requested order. Taking the left node whenever the
+ * result is not positive keeps the sort stable.
+ */
+static inline int node_cmp(const struct list_head *a,
+                           const struct list_head *b,
+                           bool descend)
+{
+    int cmp = q_element_cmp(list_entry(a, element_t, list),
+                            list_entry(b, element_t, list));
+    return descend ? -cmp : cmp;
+}
+
+/* Merge two null-terminated runs linked through next, where every node of a
+ * precedes every node of b in the original list.
+ */
+static struct list_head *merge_runs(struct list_head *a,
+                                    struct list_head *b,
+                                    bool descend)
+{
+    struct list_head *head = NULL, **tail = &head;
 
-            // 交換 `value`
-            char *temp = elem1->value;
-            elem1->value = elem2->value;
-            elem2->value = temp;
+    while (a && b) {
+        if (node_cmp(a, b, descend) <= 0) {
+            *tail = a;
+            a = a->next;
+        } else {
+            *tail = b;
+            b = b->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
 
-            left = left->next;
-            right = right->prev;
+/* Detach the natural run at the front of *list and return it null-terminated.
+ * A non-increasing run is reversed on the way, with each group of equal
+ * elements kept in its original order so the sort stays stable.
+ */
+static struct list_head *take_run(struct list_head **list, bool descend)
+{
+    struct list_head *run = *list, *cur = run, *next = run->next;
+
+    if (next && node_cmp(cur, next, descend) > 0) {
+        // group 指向目前最前方相等元素群組的最後一個節點
+        struct list_head *group = cur;
+        cur->next = NULL;
+        for (cur = next; cur; cur = next) {
+            int cmp = node_cmp(group, cur, descend);
+            if (cmp < 0)
+                break;
+            next = cur->next;
+            if (cmp) {
+                cur->next = run;
+                run = cur;
+            } else {
+                cur->next = group->next;
+                group->next = cur;
+            }
+            group = cur;
         }
+        *list = cur;
+        return run;
+    }
 
-        cur = end->next;  // 移動到下一組
+    while (next && node_cmp(cur, next, descend) <= 0) {
+        cur = next;
+        next = next->next;
     }
+    cur->next = NULL;
+    *list = next;
+    return run;
 }
 
-static inline void split_in_half(
-    struct list_head *src,      /* Modified to be the RIGHT part */
-    struct list_head *left_out) /* Output: the LEFT part */
+/* Add run to the pending slots. Like the carry of a binary counter, runs of
+ * equal rank are merged, with the pending one taken as the left input since
+ * it came earlier. Return the updated number of slots in use.
+ */
+static int push_run(struct list_head **runs,
+                    int slots,
+                    struct list_head *run,
+                    bool descend)
 {
-    // `left_out` should be initialized by the caller, or here.
-    // The original code initialized it in split_in_half, which is fine.
-    INIT_LIST_HEAD(left_out);
+    int i;
 
-    // `q_sort` ensures `src` has at least two elements when this is called.
-    struct list_head *slow_ptr =
-        src->next;  // `slow_ptr` will be the tail of the left part.
-                    // Starts at the first actual element.
-    struct list_head *fast_ptr =
-        src->next->next;  // `fast_ptr` helps find the midpoint.
-                          // Starts at the second actual element.
+    for (i = 0; runs[i]; i++) {
+        run = merge_runs(runs[i], run, descend);
+        runs[i] = NULL;
+    }
+    runs[i] = run;
+    return i >= slots ? i + 1 : slots;
+}
 
-    // Advance `fast_ptr` by two nodes and `slow_ptr` by one node.
-    // When `fast_ptr` reaches the end, `slow_ptr` will be at the end of the
-    // first half.
-    while (fast_ptr != src && fast_ptr->next != src) {
-        slow_ptr = slow_ptr->next;
-        fast_ptr = fast_ptr->next->next;
+/* Merge every pending run into one null-terminated list */
+static struct list_head *collapse_runs(struct list_head **runs,
+                                       int slots,
+                                       bool descend)
+{
+    // 較高層級的 run 來自串列前段，須作為左側輸入
+    struct list_head *list = NULL;
+    for (int i = 0; i < slots; i++) {
+        if (runs[i])
+            list = list ? merge_runs(runs[i], list, descend) : runs[i];
     }
-    list_cut_position(left_out, src, slow_ptr);
+    return list;
 }
 
+/* Link the null-terminated list behind head, restoring the prev pointers and
+ * the circular structure
+ *
+ * Return: the number of nodes linked
+ */
+static int restore_list(struct list_head *head, struct list_head *list)
+{
+    struct list_head *prev = head;
+    int n = 0;
 
-static inline void merge_two_sorted(struct list_head *dest,
-                                    struct list_head *left,
-                                    struct list_head *right,
-                                    bool descend)
+    for (struct list_head *node = list; node; node = node->next, n++) {
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+    return n;
+}
+
+/* Bottom-up merge sort over natural runs, in the spirit of the Linux kernel's
+ * lib/list_sort.c. The list is consumed in one pass while pending runs are
+ * merged like a binary counter, so there is no recursion and no repeated walk
+ * to find midpoints. Already sorted and reverse-sorted input is handled in
+ * linear time.
+ */
+static void merge_sort(struct list_head *head, bool descend)
 {
-    // `dest` is assumed to be initialized and empty by the caller (`q_sort`).
+    if (list_empty(head) || list_is_singular(head))
+        return;
 
-    while (!list_empty(left) && !list_empty(right)) {
-        element_t *a = list_first_entry(left, element_t, list);
-        element_t *b = list_first_entry(right, element_t, list);
+    struct list_head *runs[SORT_RUN_SLOTS] = {NULL};
+    struct list_head *list = head->next;
+    int slots = 0;
 
-        int cmp = strcmp(a->value, b->value);
-        if (descend) {  // If descending, reverse comparison logic
-            cmp = -cmp;
-        }
+    head->prev->next = NULL;  // 斷開環狀結構，以 next 串成單向串列
+    while (list)
+        slots = push_run(runs, slots, take_run(&list, descend), descend);
 
-        if (cmp <= 0) {  // a <= b (for ascending) or a >= b (for descending)
-            list_move_tail(&a->list, dest);
-        } else {
-            list_move_tail(&b->list, dest);
-        }
+    restore_list(head, collapse_runs(runs, slots, descend));
+}
+
+/* Queues with at least this many elements are sorted by radix sort */
+#define RADIX_SORT_MIN 1024
+
+/* Buckets smaller than this are handed to merge sort */
+#define RADIX_CUTOFF 32
+
+/* Past this many bytes of common prefix, buckets are handed to merge sort to
+ * bound the stack usage of the recursion.
+ */
+#define RADIX_MAX_DEPTH 16
+
+/* MSD radix sort on the byte at offset depth of every string. Nodes are
+ * distributed into 256 bucket lists living on the stack and concatenated back
+ * in order, so nothing is allocated, which q_sort() must honour. Appending to
+ * the bucket tails keeps equal strings in their original order. Bucket 0 holds
+ * strings ending here along with values carrying a null byte here, so it is
+ * left to merge sort, which is linear on the run of equal strings it mostly
+ * holds.
+ */
+static void radix_sort(struct list_head *head, size_t depth, bool descend)
+{
+    struct list_head buckets[256];
+    struct list_head *node, *safe;
+    int count[256] = {0};
+
+    for (int i = 0; i < 256; i++)
+        INIT_LIST_HEAD(&buckets[i]);
+
+    list_for_each_safe (node, safe, head) {
+        const element_t *e = list_entry(node, element_t, list);
+        // 前 8 個位元組可直接取自快取的鍵值
+        unsigned char c = depth < sizeof(e->key)
+                              ? e->key >> (56 - 8 * depth)
+                              : (unsigned char) e->value[depth];
+        list_move_tail(node, &buckets[c]);
+        count[c]++;
     }
 
-    /* 把剩餘節點串上去 */
-    // Use list_splice_tail_init to move all remaining elements and empty the
-    // source list.
-    if (!list_empty(left)) {
-        list_splice_tail_init(left, dest);
+    for (int i = 0; i < 256; i++) {
+        int c = descend ? 255 - i : i;
+        if (count[c] >= RADIX_CUTOFF && c && depth + 1 < RADIX_MAX_DEPTH)
+            radix_sort(&buckets[c], depth + 1, descend);
+        else
+            merge_sort(&buckets[c], descend);
+        list_splice_tail(&buckets[c], head);
     }
-    if (!list_empty(right)) {
-        list_splice_tail_init(right, dest);
+}
+
+/* Return whether the list is a single non-decreasing or non-increasing run,
+ * which merge sort handles in linear time. Random input bails out after a few
+ * comparisons.
+ */
+static bool is_monotonic(const struct list_head *head, bool descend)
+{
+    int dir = 0;
+
+    for (const struct list_head *node = head->next; node->next != head;
+         node = node->next) {
+        int cmp = node_cmp(node, node->next, descend);
+        if (!cmp)
+            continue;
+        if (!dir)
+            dir = cmp;
+        else if ((cmp > 0) != (dir > 0))
+            return false;
     }
+    return true;
 }
 
+/* Sort a list of size elements, by radix sort when it is large and unsorted
+ * and by merge sort otherwise
+ */
+static void sort_list(struct list_head *head, int size, bool descend)
+{
+    if (size >= RADIX_SORT_MIN && !is_monotonic(head, descend))
+        radix_sort(head, 0, descend);
+    else
+        merge_sort(head, descend);
+}
 
-void q_sort(struct list_head *head, bool descend)
+/* Upper bound of the sort_threads setting */
+#define SORT_THREADS_MAX 64
+
+/* Queues shorter than this many elements per thread are sorted serially */
+#define PARALLEL_SORT_MIN 16384
+
+static int sort_threads = 1;
+
+void q_set_sort_threads(int n)
 {
-    // Base cases: empty list or list with a single element is already sorted.
-    if (!head || list_empty(head) || list_is_singular(head)) {
-        return;
-    }
+    sort_threads = n < 1 ? 1 : n > SORT_THREADS_MAX ? SORT_THREADS_MAX : n;
+}
+
+/* One slice of a queue sorted by a worker thread */
+typedef struct sort_part {
+    struct list_head head;  /* The slice, as a circular list */
+    struct list_head *run;  /* The sorted slice, null-terminated */
+    struct sort_part *peer; /* Slice to merge into this one */
+    int size;
+    bool descend;
+    bool started; /* Whether a thread is working on this slice */
+    pthread_t tid;
+} sort_part_t;
+
+static void *sort_part_worker(void *arg)
+{
+    sort_part_t *part = arg;
+
+    sort_list(&part->head, part->size, part->descend);
+    part->head.prev->next = NULL;
+    part->run = part->head.next;
+    return NULL;
+}
 
+static void *merge_part_worker(void *arg)
+{
+    sort_part_t *part = arg;
 
-    struct list_head left_half;
+    part->run = merge_runs(part->run, part->peer->run, part->descend);
+    return NULL;
+}
 
-    split_in_half(head, &left_half);
+/* Run fn on every part, each but the first on a thread of its own. Signals
+ * are blocked in the workers, so the alarm of the harness and the longjmp it
+ * triggers stay on the calling thread. Parts whose thread cannot be created
+ * are processed by the caller.
+ */
+static void run_parts(sort_part_t **parts, int n, void *(*fn)(void *))
+{
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < n; i++)
+        parts[i]->started =
+            !pthread_create(&parts[i]->tid, NULL, fn, parts[i]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    fn(parts[0]);
+    for (int i = 1; i < n; i++) {
+        if (parts[i]->started)
+            pthread_join(parts[i]->tid, NULL);
+        else
+            fn(parts[i]);
+    }
+}
 
-    /* 2. 遞迴排序 (Recursive Sort) ---------------------------------------- */
-    q_sort(&left_half, descend);  // Sort the left part.
-    q_sort(head, descend);  // Sort the right part (which is now in `head`).
+/* Cut the queue into one slice per thread with list_cut_position(), sort the
+ * slices concurrently, then merge them back along a tree whose levels also run
+ * in parallel. Nothing is allocated through the harness, and merging an
+ * earlier slice as the left input keeps the sort stable.
+ *
+ * SIGALRM stays blocked until the queue is whole again, so an expired time
+ * limit is reported after the sort instead of abandoning running workers.
+ */
+static void parallel_sort(struct list_head *head,
+                          int size,
+                          int nthreads,
+                          bool descend)
+{
+    sort_part_t part[SORT_THREADS_MAX], *todo[SORT_THREADS_MAX];
+    sigset_t alarm, old;
+
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &old);
+
+    for (int i = 0; i < nthreads; i++) {
+        struct list_head *last = head;
+        part[i].size = size / nthreads + (i < size % nthreads);
+        for (int j = 0; j < part[i].size; j++)
+            last = last->next;
+        INIT_LIST_HEAD(&part[i].head);
+        list_cut_position(&part[i].head, head, last);
+        part[i].descend = descend;
+        todo[i] = &part[i];
+    }
+    run_parts(todo, nthreads, sort_part_worker);
 
-    /* 3. 合併 (Merge) ---------------------------------------------------- */
-    struct list_head merged;
-    INIT_LIST_HEAD(&merged);  // `merged` must be an initialized empty list for
-                              // `merge_two_sorted`.
+    for (int step = 1; step < nthreads; step <<= 1) {
+        int n = 0;
+        for (int i = 0; i + step < nthreads; i += step << 1) {
+            part[i].peer = &part[i + step];
+            todo[n++] = &part[i];
+        }
+        run_parts(todo, n, merge_part_worker);
+    }
 
+    restore_list(head, part[0].run);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-    merge_two_sorted(&merged, &left_half, head, descend);
+/* Sort a list of size elements, spreading the work over sort_threads threads
+ * when the list is large enough
+ */
+void sort_elements(struct list_head *head, int size, bool descend)
+{
+    int nthreads = sort_threads;
+    if (nthreads > size / PARALLEL_SORT_MIN)
+        nthreads = size / PARALLEL_SORT_MIN;
+
+    if (nthreads > 1)
+        parallel_sort(head, size, nthreads, descend);
+    else
+        sort_list(head, size, descend);
+}
 
+/* Sort elements of queue */
+void q_sort(struct list_head *head, bool descend)
+{
+    // Base cases: empty list or list with a single element is already sorted.
+    if (!head || q_header(head)->size < 2) {
+        return;
+    }
+    if (q_header(head)->ops) {
+        q_header(head)->ops->sort(q_header(head), descend);
+        return;
+    }
 
-    list_splice_tail_init(&merged, head);
+    // 先依邏輯順序排好連結，相等元素的先後才不會顛倒
+    materialize(head);
+    sort_elements(head, q_header(head)->size, descend);
 }
 
 
@@ -387,103 +1355,140 @@ void q_sort(struct list_head *head, bool descend)
  * the right side of it */
 int q_ascend(struct list_head *head)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
         return 0;
 
-    if (list_is_singular(head))
+    if (q_header(head)->size == 1)
         return 1;
 
+    if (q_header(head)->ops) {
+        q_header(head)->ops->monotonic(q_header(head), false);
+        return q_header(head)->size;
+    }
+
+    materialize(head);
     struct list_head *cur = head->prev, *prev;
-    const element_t *max_elem = list_entry(cur, element_t, list);
-    const char *max_value = max_elem->value;  // 目前的最大值
+    const element_t *min_elem = list_entry(cur, element_t, list);  // 目前的最小值
 
     while (cur != head) {
         prev = cur->prev;
         element_t *elem = list_entry(cur, element_t, list);
 
-        if (strcmp(elem->value, max_value) > 0) {
-            max_value = elem->value;  // 更新最大值
-        } else {
+        if (q_element_cmp(elem, min_elem) > 0) {
             list_del(cur);
-            free(elem->value);
-            free(elem);
+            q_release_element(elem);
+            q_header(head)->size--;
+        } else {
+            min_elem = elem;  // 更新最小值
         }
         cur = prev;  // 向左移動
     }
 
-    // 計算剩餘節點數
-    int total_size = 0;
-    list_for_each (cur, head)
-        total_size++;
-    return total_size;
+    return q_header(head)->size;
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
  * the right side of it */
 int q_descend(struct list_head *head)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_header(head)->size)
         return 0;
 
-    if (list_is_singular(head))
+    if (q_header(head)->size == 1)
         return 1;
 
+    if (q_header(head)->ops) {
+        q_header(head)->ops->monotonic(q_header(head), true);
+        return q_header(head)->size;
+    }
+
+    materialize(head);
     struct list_head *cur = head->prev, *prev;
-    const element_t *max_elem = list_entry(cur, element_t, list);
-    const char *max_value = max_elem->value;  // 目前的最大值
+    const element_t *max_elem = list_entry(cur, element_t, list);  // 目前的最大值
 
     while (cur != head) {
         prev = cur->prev;
         element_t *elem = list_entry(cur, element_t, list);
 
-        if (strcmp(elem->value, max_value) < 0) {
+        if (q_element_cmp(elem, max_elem) < 0) {
             list_del(cur);
-            free(elem->value);
-            free(elem);
+            q_release_element(elem);
+            q_header(head)->size--;
         } else {
-            max_value = elem->value;  // 更新最大值
+            max_elem = elem;  // 更新最大值
         }
 
         cur = prev;  // 向左移動
     }
 
-    // 計算剩餘節點數
-    int count = 0;
-    list_for_each (cur, head)
-        count++;
-    return count;
+    return q_header(head)->size;
 }
 
 
+/* Empty every queue of the chain into one sorted null-terminated list
+ *
+ * Each queue is already sorted, so it enters the pending slots of the merge
+ * sort as a single run. Queues are thereby merged pairwise like the rounds of
+ * a tournament, in O(N log k) time for N elements in k queues, without any
+ * allocation. Earlier queues always form the left input, which keeps equal
+ * elements in chain order.
+ */
+struct list_head *merge_chain(struct list_head *chain, bool descend)
+{
+    struct list_head *runs[SORT_RUN_SLOTS] = {NULL};
+    int slots = 0;
+
+    queue_contex_t *cur;
+    list_for_each_entry (cur, chain, chain) {
+        queue_t *q = q_header(cur->q);
+        if (!q->size)
+            continue;
+
+        // 其他儲存引擎的元素先移到暫時的串列
+        struct list_head detached, *list = cur->q;
+        if (q->ops) {
+            INIT_LIST_HEAD(&detached);
+            if (!q->ops->detach(q, &detached))
+                continue;
+            list = &detached;
+        } else {
+            materialize(list);
+        }
+
+        // 將每個已排序的 queue 視為一個 run 放入待合併的層級
+        list->prev->next = NULL;
+        slots = push_run(runs, slots, list->next, descend);
+
+        INIT_LIST_HEAD(list);
+        q->size = 0;
+    }
+    return collapse_runs(runs, slots, descend);
+}
+
 /* Merge all the queues into one sorted queue, which is in ascending/descending
- * order */
+ * order
+ */
 int q_merge(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || list_empty(head))
         return 0;
 
     // 取得第一個 queue，作為合併的結果
     queue_contex_t *first_q = list_first_entry(head, queue_contex_t, chain);
     struct list_head *first_list = first_q->q;
+    queue_t *first = q_header(first_list);
 
-    queue_contex_t *cur;
-    list_for_each_entry (cur, head, chain) {
-        if (cur == first_q || list_empty(cur->q))
-            continue;
-
-        // 直接將當前 queue 併入第一個 queue
-        list_splice_tail_init(cur->q, first_list);
+    if (first->ops) {
+        first_q->size = first->ops->merge(first, head, descend);
+        return first_q->size;
     }
 
-    // 對合併後的 queue 進行排序
-    q_sort(first_list, descend);
-
-    // 計算 queue 長度
-    int total_size = 0;
-    struct list_head *node;
-    list_for_each (node, first_list)
-        total_size++;
+    /* A queue left out by merge_chain() keeps its elements, so the size is
+     * that of the list actually linked
+     */
+    first->size = restore_list(first_list, merge_chain(head, descend));
+    first->reversed = false;
 
-    first_q->size = total_size;
-    return total_size;
+    first_q->size = first->size;
+    return first->size;
 }
\ No newline at end of file
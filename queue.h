@@ -9,6 +9,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "harness.h"
 #include "list.h"
@@ -17,14 +19,232 @@
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @key: first 8 bytes of the string, big-endian and zero-padded
+ * @len: length of the string in bytes, not counting the null terminator
+ * @data: storage for the string, allocated together with the element
+ *
+ * Elements created by the queue operations keep their string in @data, so
+ * @value points into the same allocation and moves with the node.  Only an
+ * element made by q_insert_tail_owned() has @value pointing elsewhere, to the
+ * buffer it adopted, and so do elements created in interning mode, which share
+ * one copy of each distinct string (see q_set_intern()).  Operations
+ * that reorder elements relink nodes instead of exchanging @value pointers,
+ * hence @key and @len always describe @value.  Since @len is recorded, a value
+ * may contain null bytes of its own; it is still followed by a terminator.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t key;
+    size_t len;
+    char data[];
 } element_t;
 
+/**
+ * q_key_prefix() - Compute the cached comparison key of a string
+ * @s: the string
+ * @len: length of @s in bytes
+ *
+ * Comparing two keys as integers orders the strings as memcmp() would by their
+ * first 8 bytes.
+ *
+ * Return: the first 8 bytes of @s as a big-endian integer, zero-padded
+ */
+static inline uint64_t q_key_prefix(const char *s, size_t len)
+{
+    uint64_t key = 0;
+    size_t i = 0;
+
+    for (; i < 8 && i < len; i++)
+        key = key << 8 | (unsigned char) s[i];
+    return i < 8 ? key << (8 * (8 - i)) : key;
+}
+
+/**
+ * q_element_cmp() - Compare the strings of two elements
+ * @a: element created by the queue operations
+ * @b: element created by the queue operations
+ *
+ * Elements sharing a string are equal without looking at it, and most other
+ * comparisons are settled by the cached keys; memcmp() is only consulted
+ * for strings sharing their first 8 bytes, and a string that is a prefix of
+ * the other sorts first.  Strings without null bytes compare as with strcmp().
+ *
+ * Return: an integer less than, equal to, or greater than zero
+ */
+static inline int q_element_cmp(const element_t *a, const element_t *b)
+{
+    /* Interned strings are equal exactly when they are the same copy */
+    if (a->value == b->value)
+        return 0;
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+
+    size_t len = a->len < b->len ? a->len : b->len;
+    if (len > 8) {
+        int cmp = memcmp(a->value + 8, b->value + 8, len - 8);
+        if (cmp)
+            return cmp;
+    }
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+/**
+ * q_backend_t - Storage engine of a queue
+ * @Q_BACKEND_LIST: circular doubly-linked list of elements, linked to the head
+ * @Q_BACKEND_RING: growable circular array of pointers to elements
+ * @Q_BACKEND_UNROLLED: doubly-linked list of blocks of pointers to elements
+ * @Q_BACKEND_POOL: array of index-linked nodes with strings in a shared arena
+ */
+typedef enum {
+    Q_BACKEND_LIST,
+    Q_BACKEND_RING,
+    Q_BACKEND_UNROLLED,
+    Q_BACKEND_POOL,
+} q_backend_t;
+
+struct queue_ops;
+
+/**
+ * queue_t - Header of a queue
+ * @head: list head of the queue, handed out by q_new()
+ * @size: the number of elements in the queue
+ * @reversed: whether the queue runs from @head backwards
+ * @ops: operations of the storage engine, NULL for the list linked to @head
+ *
+ * Every operation that adds or removes elements keeps @size up to date, so the
+ * length of a queue is known without walking it.
+ *
+ * With lazy reversal enabled (see q_set_lazy_reverse()), q_reverse() only
+ * flips @reversed, and the logical head of the queue is then @head.prev.  Code
+ * walking a queue from outside should go through q_first_node() and friends.
+ *
+ * Queues created by q_new_backend() for another storage engine leave @head
+ * empty and keep their elements elsewhere; they can only be walked with
+ * q_iter_first() and friends, which work for every engine.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    bool reversed;
+    const struct queue_ops *ops;
+} queue_t;
+
+/**
+ * q_header() - Get the queue header owning a list head returned by q_new()
+ * @head: header of queue
+ *
+ * Return: the queue_t embedding @head
+ */
+static inline queue_t *q_header(struct list_head *head)
+{
+    return list_entry(head, queue_t, head);
+}
+
+/**
+ * q_first_node() - Get the node at the head of the queue, in logical order
+ * @head: header of queue
+ *
+ * Return: the first node, @head itself if the queue is empty
+ */
+static inline struct list_head *q_first_node(struct list_head *head)
+{
+    return q_header(head)->reversed ? head->prev : head->next;
+}
+
+/**
+ * q_last_node() - Get the node at the tail of the queue, in logical order
+ * @head: header of queue
+ *
+ * Return: the last node, @head itself if the queue is empty
+ */
+static inline struct list_head *q_last_node(struct list_head *head)
+{
+    return q_header(head)->reversed ? head->next : head->prev;
+}
+
+/**
+ * q_next_node() - Step towards the tail of the queue, in logical order
+ * @head: header of queue
+ * @node: node of the queue
+ *
+ * Return: the node after @node, @head once past the tail
+ */
+static inline struct list_head *q_next_node(struct list_head *head,
+                                            struct list_head *node)
+{
+    return q_header(head)->reversed ? node->prev : node->next;
+}
+
+/**
+ * q_prev_node() - Step towards the head of the queue, in logical order
+ * @head: header of queue
+ * @node: node of the queue
+ *
+ * Return: the node before @node, @head once past the head
+ */
+static inline struct list_head *q_prev_node(struct list_head *head,
+                                            struct list_head *node)
+{
+    return q_header(head)->reversed ? node->next : node->prev;
+}
+
+/**
+ * q_iter_t - Position in a queue, whatever its storage engine
+ * @value: string of the element at this position
+ * @len: length of @value in bytes
+ * @id: identity of the element, which stays with its string when the queue is
+ *      reordered
+ * @q: the queue being walked
+ * @pos: position within the storage engine
+ * @index: position within the storage engine
+ *
+ * Only @value, @len and @id are meant to be read.  An iterator is invalidated
+ * by any operation modifying the queue.
+ */
+typedef struct {
+    const char *value;
+    size_t len;
+    const void *id;
+    queue_t *q;
+    void *pos;
+    size_t index;
+} q_iter_t;
+
+/**
+ * q_iter_first() - Start walking a queue from its head
+ * @head: header of queue
+ * @it: iterator to set on the first element
+ *
+ * Return: true if @it holds an element, false if the queue is NULL or empty
+ */
+bool q_iter_first(struct list_head *head, q_iter_t *it);
+
+/**
+ * q_iter_last() - Start walking a queue from its tail
+ * @head: header of queue
+ * @it: iterator to set on the last element
+ *
+ * Return: true if @it holds an element, false if the queue is NULL or empty
+ */
+bool q_iter_last(struct list_head *head, q_iter_t *it);
+
+/**
+ * q_iter_next() - Step towards the tail of the queue
+ * @it: iterator holding an element
+ *
+ * Return: true if @it holds the next element, false once past the tail
+ */
+bool q_iter_next(q_iter_t *it);
+
+/**
+ * q_iter_prev() - Step towards the head of the queue
+ * @it: iterator holding an element
+ *
+ * Return: true if @it holds the previous element, false once past the head
+ */
+bool q_iter_prev(q_iter_t *it);
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -48,6 +268,25 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/**
+ * q_new_backend() - Create an empty queue kept by the given storage engine
+ * @backend: storage engine of the queue
+ *
+ * Every q_* operation works on queues of any engine, and q_merge() accepts
+ * chains mixing them.  A queue made by q_new() is a %Q_BACKEND_LIST queue.
+ *
+ * Return: NULL for allocation failed or unknown engine
+ */
+struct list_head *q_new_backend(q_backend_t backend);
+
+/**
+ * q_backend() - Get the storage engine of a queue
+ * @head: header of queue
+ *
+ * Return: the engine given to q_new_backend(), %Q_BACKEND_LIST for q_new()
+ */
+q_backend_t q_backend(struct list_head *head);
+
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
@@ -78,6 +317,69 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_len() - Insert an element holding arbitrary bytes in the head
+ * @head: header of queue
+ * @s: bytes would be inserted, which may include null bytes
+ * @len: number of bytes in @s
+ *
+ * Like q_insert_head(), but the length is given rather than found with
+ * strlen().  The stored value is still null-terminated.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_len(struct list_head *head, const char *s, size_t len);
+
+/**
+ * q_insert_tail_len() - Insert an element holding arbitrary bytes at the tail
+ * @head: header of queue
+ * @s: bytes would be inserted, which may include null bytes
+ * @len: number of bytes in @s
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_len(struct list_head *head, const char *s, size_t len);
+
+/**
+ * q_insert_tail_owned() - Insert an element at the tail, adopting its string
+ * @head: header of queue
+ * @s: string would be inserted, allocated with malloc()
+ *
+ * Unlike q_insert_tail(), no copy is made: the element takes over @s, which is
+ * freed when the element is released.  On failure the caller keeps @s.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_owned(struct list_head *head, char *s);
+
+/**
+ * q_insert_head_n() - Insert a batch of elements in the head
+ * @head: header of queue
+ * @strs: array of the strings would be inserted
+ * @n: number of strings in @strs
+ *
+ * The queue ends up as if q_insert_head() had been called on each string in
+ * turn, so the last string of @strs becomes the head. The elements are built
+ * aside and linked to the queue with a single splice; if any of them cannot
+ * be allocated, none is inserted.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_head_n(struct list_head *head, char **strs, size_t n);
+
+/**
+ * q_insert_tail_n() - Insert a batch of elements at the tail
+ * @head: header of queue
+ * @strs: array of the strings would be inserted
+ * @n: number of strings in @strs
+ *
+ * The strings are appended in the order of @strs. As with q_insert_head_n(),
+ * either all of them are inserted or none is.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL
+ */
+bool q_insert_tail_n(struct list_head *head, char **strs, size_t n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -85,7 +387,8 @@ bool q_insert_tail(struct list_head *head, char *s);
  * @bufsize: size of the string
  *
  * If sp is non-NULL and an element is removed, copy the removed string to *sp
- * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * (up to a maximum of bufsize-1 characters, plus a null terminator.)  Only the
+ * bytes of the string are written; the rest of the buffer is left untouched.
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
@@ -108,22 +411,109 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_pop_head() - Remove the element from head of queue without copying
+ * @head: header of queue
+ *
+ * The caller reads the string in place through the value of the returned
+ * element and releases it with q_release_element() once done.
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+element_t *q_pop_head(struct list_head *head);
+
+/**
+ * q_remove_head_n() - Remove a batch of elements from head of queue
+ * @head: header of queue
+ * @out: list head that receives the removed elements
+ * @n: maximum number of elements to remove
+ * @buf: output buffer where the removed strings are packed, or NULL
+ * @bufsize: size of @buf
+ * @offsets: array of at least @n entries receiving the offset of each string
+ *           in @buf, or NULL
+ *
+ * The removed elements are cut off the queue at once and linked to @out in
+ * queue order, ready to be released with q_release_list(). Their strings are
+ * copied to @buf one after another, each with its null terminator, in the
+ * order repeated q_remove_head() calls would return them. A string that does
+ * not fit is truncated, and once @buf is full the remaining strings are empty.
+ *
+ * Return: the number of elements removed, less than @n if the queue is shorter
+ */
+size_t q_remove_head_n(struct list_head *head,
+                       struct list_head *out,
+                       size_t n,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets);
+
+/**
+ * q_remove_tail_n() - Remove a batch of elements from tail of queue
+ * @head: header of queue
+ * @out: list head that receives the removed elements
+ * @n: maximum number of elements to remove
+ * @buf: output buffer where the removed strings are packed, or NULL
+ * @bufsize: size of @buf
+ * @offsets: array of at least @n entries receiving the offset of each string
+ *           in @buf, or NULL
+ *
+ * As q_remove_head_n(), with the strings packed in the order repeated
+ * q_remove_tail() calls would return them, starting from the tail.
+ *
+ * Return: the number of elements removed, less than @n if the queue is shorter
+ */
+size_t q_remove_tail_n(struct list_head *head,
+                       struct list_head *out,
+                       size_t n,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets);
+
+/**
+ * q_release_list() - Release every element of a detached list
+ * @list: list filled by q_remove_head_n() or q_remove_tail_n()
+ *
+ * @list is left empty.
+ */
+void q_release_list(struct list_head *list);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * Elements are allocated from a slab cache, so they must be released through
+ * this function rather than free().
+ *
  * This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
+
+/**
+ * q_shrink_cache() - Return cached empty slabs to the allocator
+ *
+ * The element cache holds on to one empty slab after its last element is
+ * released. Call this before checking for leaked blocks once every queue has
+ * been freed.
+ */
+void q_shrink_cache(void);
+
+/**
+ * q_set_intern() - Turn string interning on or off
+ * @enable: whether elements created from now on share their strings
+ *
+ * In interning mode the insertion functions keep a single reference-counted
+ * copy of every distinct string, which the elements point to instead of
+ * holding a copy each.  Elements created in either mode may be mixed freely;
+ * the shared copy is freed along with the last element referring to it.
+ */
+void q_set_intern(bool enable);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * Runs in constant time, reading the count kept in the queue header.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -175,6 +565,16 @@ void q_swap(struct list_head *head);
  */
 void q_reverse(struct list_head *head);
 
+/**
+ * q_set_lazy_reverse() - Turn lazy reversal on or off
+ * @enable: whether q_reverse() only flips the direction of the queue
+ *
+ * With lazy reversal, q_reverse() runs in constant time.  Operations at either
+ * end honour the direction, and those that need the links in order, such as
+ * q_sort() and q_reverseK(), reverse the list physically first.
+ */
+void q_set_lazy_reverse(bool enable);
+
 /**
  * q_reverseK() - Given the head of a linked list, reverse the nodes of the list
  * k at a time.
@@ -200,6 +600,15 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_set_sort_threads() - Set the number of threads used by q_sort()
+ * @n: number of threads, clamped to the range 1 to 64
+ *
+ * Large queues are cut into @n slices that are sorted and merged back on
+ * separate threads. The default of 1 keeps q_sort() on the calling thread.
+ */
+void q_set_sort_threads(int n);
+
 /**
  * q_ascend() - Delete every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -242,6 +651,11 @@ int q_descend(struct list_head *head);
  * in this function. There is no need to free the 'queue_contex_t' and its
  * member 'q' since they will be released externally. However, q_merge() is
  * responsible for making the queues to be NULL-queue, except the first one.
+ * Only a first queue kept in an array by its storage engine may allocate, to
+ * grow the array; if that fails, the chain is left untouched.  Queues of the
+ * %Q_BACKEND_POOL engine allocate too: a first one copies the strings of the
+ * others, and any other one builds elements for them, being left out of the
+ * merge if it cannot.
  *
  * Reference:
  * https://leetcode.com/problems/merge-k-sorted-lists/
@@ -0,0 +1,89 @@
+#ifndef LAB0_QUEUE_BACKEND_H
+#define LAB0_QUEUE_BACKEND_H
+
+/* Interface between queue.c and the storage engines other than the list.
+ *
+ * The q_* functions check their arguments, deal with NULL and empty queues,
+ * and hand everything else to the engine of the queue, so an operation below
+ * is only called on a queue with at least one element unless noted otherwise.
+ * Engines keep queue_t.size up to date themselves.
+ */
+
+#include <pthread.h>
+
+#include "queue.h"
+
+struct queue_ops {
+    q_backend_t backend;
+
+    /* Allocate an empty queue, NULL on failure */
+    queue_t *(*create)(void);
+    /* Release every element and the queue itself; the queue may be empty */
+    void (*destroy)(queue_t *q);
+
+    /* Add a copy of the len bytes at s at either end; the queue may be
+     * empty.  Nothing is changed on failure.
+     */
+    bool (*insert)(queue_t *q, const char *s, size_t len, bool tail);
+    /* Add an element adopting s at the tail; the queue may be empty.  The
+     * caller keeps s on failure.
+     */
+    bool (*insert_owned)(queue_t *q, char *s);
+    /* Unlink the element at either end and hand it over.  Engines that do
+     * not keep elements build one, and return NULL if that fails.
+     */
+    element_t *(*remove)(queue_t *q, bool tail);
+    /* Delete the element at either end; if NULL, remove is used instead */
+    void (*drop)(queue_t *q, bool tail);
+
+    void (*delete_mid)(queue_t *q);
+    void (*delete_dup)(queue_t *q);
+    void (*swap)(queue_t *q);
+    void (*reverse)(queue_t *q);
+    void (*reverseK)(queue_t *q, int k);
+    void (*sort)(queue_t *q, bool descend);
+    /* Delete every element followed by a strictly smaller one, or by a
+     * strictly greater one when descend is set
+     */
+    void (*monotonic)(queue_t *q, bool descend);
+
+    /* Move every element to the list in queue order, leaving the queue empty.
+     * This must not allocate, except in engines that do not keep elements;
+     * these leave the queue untouched and return false if that fails.
+     */
+    bool (*detach)(queue_t *q, struct list_head *list);
+    /* Merge every queue of the chain into q, the first one */
+    int (*merge)(queue_t *q, struct list_head *chain, bool descend);
+
+    /* Set it on the first or last element */
+    bool (*iter_end)(q_iter_t *it, bool last);
+    /* Step it towards the tail, or the head when back is set */
+    bool (*iter_step)(q_iter_t *it, bool back);
+};
+
+extern const struct queue_ops ring_ops;
+extern const struct queue_ops unrolled_ops;
+extern const struct queue_ops pool_ops;
+
+/* Elements shared by the engines, from the slab cache of queue.c */
+element_t *element_new(const char *s, size_t len);
+element_t *element_adopt(char *s);
+void element_free(element_t *e);
+
+/* Neither the slab cache nor the allocator of the harness is thread-safe, so
+ * the queues shared between threads hold this lock while allocating or
+ * releasing anything
+ */
+extern pthread_mutex_t element_lock;
+
+/* Sort a circular list of size elements the way q_sort() sorts a list queue */
+void sort_elements(struct list_head *head, int size, bool descend);
+
+/* Empty every queue of the chain, returning their elements as a single sorted
+ * null-terminated list linked through next.  Nothing is allocated unless a
+ * queue of the chain has to build its elements; a queue failing to do so is
+ * left out.
+ */
+struct list_head *merge_chain(struct list_head *chain, bool descend);
+
+#endif /* LAB0_QUEUE_BACKEND_H */
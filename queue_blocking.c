@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "queue_backend.h"
+#include "queue_blocking.h"
+
+/* Timed waits run on the monotonic clock, unaffected by changes of the date,
+ * where condition variables can be told to use it
+ */
+#if defined(__APPLE__)
+#define BQ_CLOCK CLOCK_REALTIME
+#else
+#define BQ_CLOCK CLOCK_MONOTONIC
+#endif
+
+struct bqueue {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    struct list_head *q; /* List queue made by q_new() */
+    int waiting;         /* Consumers asleep on nonempty */
+    bool closed;
+};
+
+bqueue_t *bq_new(void)
+{
+    pthread_mutex_lock(&element_lock);
+    bqueue_t *bq = malloc(sizeof(bqueue_t));
+    struct list_head *q = bq ? q_new() : NULL;
+    if (bq && !q) {
+        free(bq);
+        bq = NULL;
+    }
+    pthread_mutex_unlock(&element_lock);
+    if (!bq)
+        return NULL;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&attr, BQ_CLOCK);
+#endif
+    pthread_cond_init(&bq->nonempty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&bq->lock, NULL);
+    bq->q = q;
+    bq->waiting = 0;
+    bq->closed = false;
+    return bq;
+}
+
+void bq_free(bqueue_t *bq)
+{
+    if (!bq)
+        return;
+
+    pthread_cond_destroy(&bq->nonempty);
+    pthread_mutex_destroy(&bq->lock);
+    pthread_mutex_lock(&element_lock);
+    q_free(bq->q);
+    free(bq);
+    pthread_mutex_unlock(&element_lock);
+}
+
+bool bq_insert_tail_n(bqueue_t *bq, char **strs, size_t n)
+{
+    if (!bq)
+        return false;
+
+    pthread_mutex_lock(&bq->lock);
+    bool was_empty = list_empty(bq->q), ok = !bq->closed;
+    if (ok) {
+        pthread_mutex_lock(&element_lock);
+        ok = q_insert_tail_n(bq->q, strs, n);
+        pthread_mutex_unlock(&element_lock);
+    }
+    // 只在佇列由空轉為非空時喚醒一個消費者，其餘由消費者接力喚醒
+    if (ok && was_empty && n && bq->waiting)
+        pthread_cond_signal(&bq->nonempty);
+    pthread_mutex_unlock(&bq->lock);
+    return ok;
+}
+
+bool bq_insert_tail(bqueue_t *bq, char *s)
+{
+    return s && bq_insert_tail_n(bq, &s, 1);
+}
+
+/* Compute the time timeout_ns from now on BQ_CLOCK */
+static void deadline_after(struct timespec *ts, int64_t timeout_ns)
+{
+    clock_gettime(BQ_CLOCK, ts);
+    int64_t nsec = ts->tv_nsec + timeout_ns % 1000000000;
+    ts->tv_sec += timeout_ns / 1000000000 + nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+}
+
+element_t *bq_remove_head_wait(bqueue_t *bq,
+                               char *sp,
+                               size_t bufsize,
+                               int64_t timeout_ns)
+{
+    if (!bq)
+        return NULL;
+
+    struct timespec deadline;
+    if (timeout_ns > 0)
+        deadline_after(&deadline, timeout_ns);
+
+    pthread_mutex_lock(&bq->lock);
+    bool expired = !timeout_ns;
+    // 被喚醒後不論原因都先檢查佇列，才不會漏接交給自己的喚醒
+    while (list_empty(bq->q) && !bq->closed && !expired) {
+        bq->waiting++;
+        if (timeout_ns < 0)
+            pthread_cond_wait(&bq->nonempty, &bq->lock);
+        else
+            expired = pthread_cond_timedwait(&bq->nonempty, &bq->lock,
+                                             &deadline) == ETIMEDOUT;
+        bq->waiting--;
+    }
+
+    element_t *e = q_remove_head(bq->q, sp, bufsize);
+    if (e && !list_empty(bq->q) && bq->waiting)
+        pthread_cond_signal(&bq->nonempty);
+    pthread_mutex_unlock(&bq->lock);
+    return e;
+}
+
+void bq_close(bqueue_t *bq)
+{
+    if (!bq)
+        return;
+
+    pthread_mutex_lock(&bq->lock);
+    bq->closed = true;
+    pthread_cond_broadcast(&bq->nonempty);
+    pthread_mutex_unlock(&bq->lock);
+}
+
+bool bq_closed(bqueue_t *bq)
+{
+    if (!bq)
+        return true;
+
+    pthread_mutex_lock(&bq->lock);
+    bool closed = bq->closed;
+    pthread_mutex_unlock(&bq->lock);
+    return closed;
+}
+
+void bq_release_element(element_t *e)
+{
+    if (!e)
+        return;
+    pthread_mutex_lock(&element_lock);
+    q_release_element(e);
+    pthread_mutex_unlock(&element_lock);
+}
@@ -0,0 +1,103 @@
+#ifndef LAB0_QUEUE_BLOCKING_H
+#define LAB0_QUEUE_BLOCKING_H
+
+/* Thread-safe wrapper around a list queue, whose consumers sleep on a
+ * condition variable while the queue is empty instead of polling it.
+ *
+ * Producers wake a single consumer when the queue stops being empty, however
+ * many elements they insert at once, and a consumer leaving elements behind
+ * wakes the next one if any is waiting.  Hence a burst of insertions wakes
+ * consumers one by one as they are needed, never the whole herd.
+ *
+ * Closing the queue turns further insertions away and wakes every consumer;
+ * the elements left can still be removed, after which removal returns NULL
+ * right away.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+typedef struct bqueue bqueue_t;
+
+/**
+ * bq_new() - Create an empty, open blocking queue
+ *
+ * Return: NULL for allocation failed
+ */
+bqueue_t *bq_new(void);
+
+/**
+ * bq_free() - Free all storage used by the queue, no effect if bq is NULL
+ * @bq: queue no other thread is using anymore
+ */
+void bq_free(bqueue_t *bq);
+
+/**
+ * bq_insert_tail() - Insert an element at the tail, from any thread
+ * @bq: blocking queue
+ * @s: string would be inserted
+ *
+ * Return: true for success, false for allocation failed, queue closed or
+ * bq is NULL
+ */
+bool bq_insert_tail(bqueue_t *bq, char *s);
+
+/**
+ * bq_insert_tail_n() - Insert a batch of elements at the tail, from any thread
+ * @bq: blocking queue
+ * @strs: array of the strings would be inserted
+ * @n: number of strings in @strs
+ *
+ * All of them are inserted or none is, as with q_insert_tail_n(), under a
+ * single acquisition of the lock and with at most one wake-up.
+ *
+ * Return: true for success, false for allocation failed, queue closed or
+ * bq is NULL
+ */
+bool bq_insert_tail_n(bqueue_t *bq, char **strs, size_t n);
+
+/**
+ * bq_remove_head_wait() - Remove the element at the head, waiting for one
+ * @bq: blocking queue
+ * @sp: string would be inserted
+ * @bufsize: size of the string
+ * @timeout_ns: longest wait in nanoseconds, negative to wait without limit
+ *
+ * Behaves as q_remove_head() once an element is available.  With a zero
+ * @timeout_ns, it returns at once.
+ *
+ * Return: the removed element, to be released with bq_release_element(), or
+ * NULL if the time ran out, the queue is closed and empty, or bq is NULL.
+ * bq_closed() tells the cases apart.
+ */
+element_t *bq_remove_head_wait(bqueue_t *bq,
+                               char *sp,
+                               size_t bufsize,
+                               int64_t timeout_ns);
+
+/**
+ * bq_close() - Close the queue and wake every waiting consumer
+ * @bq: blocking queue, no effect if NULL
+ */
+void bq_close(bqueue_t *bq);
+
+/**
+ * bq_closed() - Check whether the queue has been closed
+ * @bq: blocking queue
+ *
+ * Return: true if bq_close() was called or bq is NULL
+ */
+bool bq_closed(bqueue_t *bq);
+
+/**
+ * bq_release_element() - Release an element removed from a blocking queue
+ * @e: element, no effect if NULL
+ *
+ * Safe to call from any thread, unlike q_release_element().
+ */
+void bq_release_element(element_t *e);
+
+#endif /* LAB0_QUEUE_BLOCKING_H */
@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue_backend.h"
+#include "queue_mpmc.h"
+
+/* Threads operating on one queue at the same time. Any more wait for one of
+ * them to finish its operation.
+ */
+#define MPMC_SLOTS MPMC_THREADS_MAX
+
+/* Hazard pointers per slot: the node read and the one after it */
+#define MPMC_HAZARDS 2
+
+/* Removed nodes a slot collects before freeing those no longer in use. Twice
+ * the number of hazard pointers, so each scan frees at least half of them.
+ */
+#define MPMC_RETIRE_MAX (2 * MPMC_SLOTS * MPMC_HAZARDS)
+
+typedef struct mpmc_node {
+    _Atomic(struct mpmc_node *) next;
+    element_t *elem; /* Stale once the node has become the dummy */
+} mpmc_node_t;
+
+/* What a thread owns while operating on the queue. The retired nodes stay
+ * with the slot, to be freed by whichever thread takes it next.
+ */
+typedef struct {
+    _Atomic(mpmc_node_t *) hazard[MPMC_HAZARDS];
+    atomic_bool busy;
+    size_t nretired;
+    mpmc_node_t *retired[MPMC_RETIRE_MAX];
+} mpmc_slot_t;
+
+/* Padding keeping the head and tail pointers on cache lines of their own,
+ * since malloc() does not align beyond 16 bytes
+ */
+#define MPMC_PAD (64 - sizeof(void *))
+
+struct mpmc {
+    // 頭尾指標分置於不同的快取列，生產者與消費者才不會互相干擾
+    _Atomic(mpmc_node_t *) head;
+    char pad_head[MPMC_PAD];
+    _Atomic(mpmc_node_t *) tail;
+    char pad_tail[MPMC_PAD];
+    mpmc_slot_t slots[MPMC_SLOTS];
+};
+
+/* Slot this thread took last, tried first next time */
+static _Thread_local unsigned slot_hint;
+
+static mpmc_slot_t *slot_acquire(mpmc_t *q)
+{
+    for (;;) {
+        for (unsigned i = 0; i < MPMC_SLOTS; i++) {
+            unsigned n = (slot_hint + i) % MPMC_SLOTS;
+            mpmc_slot_t *slot = &q->slots[n];
+            if (!atomic_load_explicit(&slot->busy, memory_order_relaxed) &&
+                !atomic_exchange_explicit(&slot->busy, true,
+                                          memory_order_acquire)) {
+                slot_hint = n;
+                return slot;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static inline void slot_release(mpmc_slot_t *slot)
+{
+    for (int i = 0; i < MPMC_HAZARDS; i++)
+        atomic_store(&slot->hazard[i], NULL);
+    atomic_store_explicit(&slot->busy, false, memory_order_release);
+}
+
+/* Read *src into a hazard pointer, retrying until the pointer published is
+ * still the one in *src, hence not yet retired
+ */
+static inline mpmc_node_t *protect(_Atomic(mpmc_node_t *) *hazard,
+                                   _Atomic(mpmc_node_t *) *src)
+{
+    mpmc_node_t *node = atomic_load(src), *again;
+
+    for (;; node = again) {
+        atomic_store(hazard, node);
+        again = atomic_load(src);
+        if (again == node)
+            return node;
+    }
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the retired nodes of the slot that no hazard pointer refers to */
+static void scan(mpmc_t *q, mpmc_slot_t *slot)
+{
+    void *hazards[MPMC_SLOTS * MPMC_HAZARDS];
+    size_t nhazards = 0, kept = 0;
+
+    for (int i = 0; i < MPMC_SLOTS; i++) {
+        for (int j = 0; j < MPMC_HAZARDS; j++) {
+            void *p = atomic_load(&q->slots[i].hazard[j]);
+            if (p)
+                hazards[nhazards++] = p;
+        }
+    }
+    qsort(hazards, nhazards, sizeof(void *), ptr_cmp);
+
+    pthread_mutex_lock(&element_lock);
+    for (size_t i = 0; i < slot->nretired; i++) {
+        mpmc_node_t *node = slot->retired[i];
+        if (bsearch(&node, hazards, nhazards, sizeof(void *), ptr_cmp))
+            slot->retired[kept++] = node;
+        else
+            free(node);
+    }
+    pthread_mutex_unlock(&element_lock);
+    slot->nretired = kept;
+}
+
+static inline void retire(mpmc_t *q, mpmc_slot_t *slot, mpmc_node_t *node)
+{
+    slot->retired[slot->nretired++] = node;
+    if (slot->nretired == MPMC_RETIRE_MAX)
+        scan(q, slot);
+}
+
+mpmc_t *mpmc_new(void)
+{
+    pthread_mutex_lock(&element_lock);
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    mpmc_node_t *dummy = q ? malloc(sizeof(mpmc_node_t)) : NULL;
+    if (q && !dummy) {
+        free(q);
+        q = NULL;
+    }
+    pthread_mutex_unlock(&element_lock);
+    if (!q)
+        return NULL;
+
+    atomic_init(&dummy->next, NULL);
+    dummy->elem = NULL;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    for (int i = 0; i < MPMC_SLOTS; i++) {
+        for (int j = 0; j < MPMC_HAZARDS; j++)
+            atomic_init(&q->slots[i].hazard[j], NULL);
+        atomic_init(&q->slots[i].busy, false);
+        q->slots[i].nretired = 0;
+    }
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+
+    pthread_mutex_lock(&element_lock);
+    mpmc_node_t *node = atomic_load(&q->head), *next;
+    for (bool dummy = true; node; node = next, dummy = false) {
+        next = atomic_load(&node->next);
+        if (!dummy)
+            q_release_element(node->elem);
+        free(node);
+    }
+    for (int i = 0; i < MPMC_SLOTS; i++) {
+        for (size_t j = 0; j < q->slots[i].nretired; j++)
+            free(q->slots[i].retired[j]);
+    }
+    free(q);
+    pthread_mutex_unlock(&element_lock);
+}
+
+bool mpmc_insert_tail(mpmc_t *q, const char *s)
+{
+    if (!q || !s)
+        return false;
+
+    pthread_mutex_lock(&element_lock);
+    mpmc_node_t *node = malloc(sizeof(mpmc_node_t));
+    element_t *e = node ? element_new(s, strlen(s)) : NULL;
+    if (node && !e) {
+        free(node);
+        node = NULL;
+    }
+    pthread_mutex_unlock(&element_lock);
+    if (!node)
+        return false;
+
+    atomic_init(&node->next, NULL);
+    node->elem = e;
+
+    mpmc_slot_t *slot = slot_acquire(q);
+    for (;;) {
+        mpmc_node_t *tail = protect(&slot->hazard[0], &q->tail);
+        mpmc_node_t *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+        // 尾指標落後時先幫忙推進，再重試
+        if (next) {
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&tail->next, &next, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    slot_release(slot);
+    return true;
+}
+
+element_t *mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return NULL;
+
+    mpmc_slot_t *slot = slot_acquire(q);
+    element_t *e = NULL;
+    for (;;) {
+        mpmc_node_t *head = protect(&slot->hazard[0], &q->head);
+        mpmc_node_t *tail = atomic_load(&q->tail);
+        mpmc_node_t *next = atomic_load(&head->next);
+        atomic_store(&slot->hazard[1], next);
+        // 確認 head 仍未被移除，next 才確定受保護
+        if (head != atomic_load(&q->head))
+            continue;
+        if (!next)
+            break;
+        if (head == tail) {
+            atomic_compare_exchange_strong(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&q->head, &head, next)) {
+            // next 成為新的 dummy，其元素交給呼叫者
+            e = next->elem;
+            retire(q, slot, head);
+            break;
+        }
+    }
+    slot_release(slot);
+
+    if (e && sp && bufsize > 0) {
+        size_t len = e->len < bufsize - 1 ? e->len : bufsize - 1;
+        memcpy(sp, e->value, len);
+        sp[len] = '\0';
+    }
+    return e;
+}
+
+void mpmc_release_element(element_t *e)
+{
+    if (!e)
+        return;
+    pthread_mutex_lock(&element_lock);
+    q_release_element(e);
+    pthread_mutex_unlock(&element_lock);
+}
@@ -0,0 +1,78 @@
+#ifndef LAB0_QUEUE_MPMC_H
+#define LAB0_QUEUE_MPMC_H
+
+/* Lock-free queue shared by several producer and consumer threads.
+ *
+ * It is the lock-free queue of Michael and Scott, a singly-linked list with a
+ * dummy node at the head, whose removed nodes are reclaimed with hazard
+ * pointers.  Strings are stored in elements, as with the queues of
+ * queue.h, and consumers receive these elements.
+ *
+ * The allocator of the harness is not thread-safe, so every allocation and
+ * release made by these functions takes a global lock: mpmc_insert_tail()
+ * always waits for it, and mpmc_remove_head() whenever it frees the nodes it
+ * has collected.  Only the linking and unlinking of nodes is lock-free.
+ *
+ * Each thread operating on a queue holds one of MPMC_THREADS_MAX hazard
+ * pointer slots; threads beyond that spin until a slot is released, so a
+ * queue should not be shared by more threads than that.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+/* Threads that can operate on one queue at the same time */
+#define MPMC_THREADS_MAX 32
+
+typedef struct mpmc mpmc_t;
+
+/**
+ * mpmc_new() - Create an empty concurrent queue
+ *
+ * Return: NULL for allocation failed
+ */
+mpmc_t *mpmc_new(void);
+
+/**
+ * mpmc_free() - Free all storage used by the queue, no effect if q is NULL
+ * @q: queue no other thread is using anymore
+ */
+void mpmc_free(mpmc_t *q);
+
+/**
+ * mpmc_insert_tail() - Insert an element at the tail, from any thread
+ * @q: concurrent queue
+ * @s: string would be inserted
+ *
+ * The string is copied as q_insert_tail() does.
+ *
+ * Return: true for success, false for allocation failed or q is NULL
+ */
+bool mpmc_insert_tail(mpmc_t *q, const char *s);
+
+/**
+ * mpmc_remove_head() - Remove the element at the head, from any thread
+ * @q: concurrent queue
+ * @sp: string would be inserted
+ * @bufsize: size of the string
+ *
+ * Behaves as q_remove_head(): the value is copied to @sp, if non-NULL, up to
+ * @bufsize - 1 characters plus a null terminator.  Each element inserted is
+ * removed by exactly one call, in the order of insertion.
+ *
+ * Return: the removed element, NULL if the queue is NULL or found empty.
+ * Release it with mpmc_release_element().
+ */
+element_t *mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize);
+
+/**
+ * mpmc_release_element() - Release an element removed from a concurrent queue
+ * @e: element, no effect if NULL
+ *
+ * Safe to call from any thread, unlike q_release_element().
+ */
+void mpmc_release_element(element_t *e);
+
+#endif /* LAB0_QUEUE_MPMC_H */
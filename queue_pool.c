@@ -0,0 +1,570 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue_backend.h"
+
+/* Node pool storage engine
+ *
+ * The queue keeps no elements at all.  Its nodes live in one growable array
+ * and link to each other with 32-bit indices, and each node refers to its
+ * string by a 32-bit offset into a growable arena, where the strings lie one
+ * after another with their null terminators.  A node takes 24 bytes, comparison
+ * key included, against a list element carrying two pointers, a string
+ * pointer, the slab pointer and the rounding of its size class.
+ *
+ * Node 0 is the sentinel of the circular list, like the head of a list queue,
+ * and doubles as the null index.  Deleted nodes go on a free list; deleted
+ * strings leave holes in the arena, which is compacted once they make up
+ * more than half of it.
+ *
+ * q_remove_head() and q_remove_tail() build an element from the slab cache
+ * of queue.c to hand out, so unlike with the other engines they allocate and
+ * may fail.  The identity of an element, as q_iter_t reports it, is the
+ * address of its string, since reordering exchanges strings between nodes.
+ */
+#define POOL_MIN_NODES 16
+#define POOL_MIN_ARENA 256
+
+/* Arenas smaller than this are never compacted */
+#define POOL_COMPACT_MIN 65536
+
+typedef struct {
+    uint32_t prev, next;
+    uint32_t off; /* Offset of the string in the arena */
+    uint32_t len;
+    uint64_t key;
+} pnode_t;
+
+typedef struct {
+    queue_t q;
+    pnode_t *nodes;
+    uint32_t nnodes;   /* Nodes ever used, the sentinel included */
+    uint32_t capacity; /* Nodes allocated */
+    uint32_t free;     /* First node of the free list, 0 if it is empty */
+    uint32_t nfree;    /* Number of nodes on the free list */
+    char *arena;
+    size_t used;    /* Bytes of the arena ever used */
+    size_t size;    /* Bytes of the arena allocated */
+    size_t garbage; /* Bytes used by deleted strings */
+} pool_t;
+
+static inline pool_t *pool_of(queue_t *q)
+{
+    return container_of(q, pool_t, q);
+}
+
+static inline const char *node_value(const pool_t *p, uint32_t i)
+{
+    return p->arena + p->nodes[i].off;
+}
+
+/* Compare the strings of two nodes as q_element_cmp() compares elements */
+static int node_cmp(const pool_t *p, uint32_t a, uint32_t b, bool descend)
+{
+    const pnode_t *x = &p->nodes[a], *y = &p->nodes[b];
+    int cmp;
+
+    if (x->key != y->key) {
+        cmp = x->key < y->key ? -1 : 1;
+    } else {
+        uint32_t len = x->len < y->len ? x->len : y->len;
+        cmp = len > 8 ? memcmp(node_value(p, a) + 8, node_value(p, b) + 8,
+                               len - 8)
+                      : 0;
+        if (!cmp)
+            cmp = (x->len > y->len) - (x->len < y->len);
+    }
+    return descend ? -cmp : cmp;
+}
+
+/* Make room for n more nodes and bytes more of strings. Either array may have
+ * grown when this fails, but nothing else changes.
+ */
+static bool pool_reserve(pool_t *p, size_t n, size_t bytes)
+{
+    size_t need = n > p->nfree ? (size_t) p->nnodes + n - p->nfree : 0;
+    if (need > p->capacity) {
+        size_t capacity = (size_t) p->capacity * 2;
+        if (capacity < need)
+            capacity = need;
+        if (capacity > UINT32_MAX)
+            capacity = UINT32_MAX;
+        if (need > capacity)
+            return false;
+        pnode_t *nodes = realloc(p->nodes, capacity * sizeof(*nodes));
+        if (!nodes)
+            return false;
+        p->nodes = nodes;
+        p->capacity = capacity;
+    }
+
+    need = p->used + bytes;
+    if (need > p->size) {
+        size_t size = p->size ? p->size * 2 : POOL_MIN_ARENA;
+        if (size < need)
+            size = need;
+        // 偏移量只有 32 位元
+        if (size > (size_t) UINT32_MAX + 1)
+            size = (size_t) UINT32_MAX + 1;
+        if (need > size)
+            return false;
+        char *arena = realloc(p->arena, size);
+        if (!arena)
+            return false;
+        p->arena = arena;
+        p->size = size;
+    }
+    return true;
+}
+
+/* Store a copy of the len bytes at s in a new node, in room made by
+ * pool_reserve(), and link it at either end
+ */
+static void pool_push(pool_t *p, const char *s, size_t len, bool tail)
+{
+    uint32_t i;
+    if (p->free) {
+        i = p->free;
+        p->free = p->nodes[i].next;
+        p->nfree--;
+    } else {
+        i = p->nnodes++;
+    }
+
+    pnode_t *node = &p->nodes[i];
+    node->off = p->used;
+    node->len = len;
+    node->key = q_key_prefix(s, len);
+    memcpy(p->arena + p->used, s, len);
+    p->arena[p->used + len] = '\0';
+    p->used += len + 1;
+
+    node->prev = tail ? p->nodes[0].prev : 0;
+    node->next = tail ? 0 : p->nodes[0].next;
+    p->nodes[node->prev].next = i;
+    p->nodes[node->next].prev = i;
+    p->q.size++;
+}
+
+/* Forget every node and string, keeping both arrays */
+static void pool_clear(pool_t *p)
+{
+    p->nodes[0].prev = p->nodes[0].next = 0;
+    p->nnodes = 1;
+    p->free = p->nfree = 0;
+    p->used = p->garbage = 0;
+    p->q.size = 0;
+}
+
+/* Move the live strings to a new arena in queue order, once deleted strings
+ * take up more than half of the arena. Failing to allocate only delays it.
+ */
+static void pool_compact(pool_t *p)
+{
+    if (p->used < POOL_COMPACT_MIN || p->garbage <= p->used / 2)
+        return;
+
+    size_t live = p->used - p->garbage;
+    char *arena = malloc(live * 2);
+    if (!arena)
+        return;
+
+    size_t used = 0;
+    for (uint32_t i = p->nodes[0].next; i; i = p->nodes[i].next) {
+        memcpy(arena + used, node_value(p, i), p->nodes[i].len + 1);
+        p->nodes[i].off = used;
+        used += p->nodes[i].len + 1;
+    }
+    free(p->arena);
+    p->arena = arena;
+    p->size = live * 2;
+    p->used = used;
+    p->garbage = 0;
+}
+
+/* Unlink node i and put it on the free list along with its string */
+static void pool_delete(pool_t *p, uint32_t i)
+{
+    pnode_t *node = &p->nodes[i];
+
+    p->nodes[node->prev].next = node->next;
+    p->nodes[node->next].prev = node->prev;
+    node->next = p->free;
+    p->free = i;
+    p->nfree++;
+    p->garbage += node->len + 1;
+    if (!--p->q.size)
+        pool_clear(p);
+}
+
+static queue_t *pool_create(void)
+{
+    pool_t *p = malloc(sizeof(pool_t));
+    if (!p)
+        return NULL;
+    p->nodes = malloc(POOL_MIN_NODES * sizeof(pnode_t));
+    if (!p->nodes) {
+        free(p);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&p->q.head);
+    p->q.reversed = false;
+    p->q.ops = &pool_ops;
+    p->capacity = POOL_MIN_NODES;
+    p->arena = NULL;
+    p->size = 0;
+    pool_clear(p);
+    return &p->q;
+}
+
+static void pool_destroy(queue_t *q)
+{
+    pool_t *p = pool_of(q);
+
+    free(p->nodes);
+    free(p->arena);
+    free(p);
+}
+
+static bool pool_insert(queue_t *q, const char *s, size_t len, bool tail)
+{
+    pool_t *p = pool_of(q);
+
+    if (len >= UINT32_MAX || !pool_reserve(p, 1, len + 1))
+        return false;
+    pool_push(p, s, len, tail);
+    return true;
+}
+
+/* The string is copied into the arena and freed right away */
+static bool pool_insert_owned(queue_t *q, char *s)
+{
+    if (!pool_insert(q, s, strlen(s), true))
+        return false;
+    free(s);
+    return true;
+}
+
+static element_t *pool_remove(queue_t *q, bool tail)
+{
+    pool_t *p = pool_of(q);
+    uint32_t i = tail ? p->nodes[0].prev : p->nodes[0].next;
+
+    element_t *e = element_new(node_value(p, i), p->nodes[i].len);
+    if (!e)
+        return NULL;
+    pool_delete(p, i);
+    pool_compact(p);
+    return e;
+}
+
+static void pool_drop(queue_t *q, bool tail)
+{
+    pool_t *p = pool_of(q);
+
+    pool_delete(p, tail ? p->nodes[0].prev : p->nodes[0].next);
+    pool_compact(p);
+}
+
+static void pool_delete_mid(queue_t *q)
+{
+    pool_t *p = pool_of(q);
+    uint32_t mid = q->size / 2, i;
+
+    if (mid < q->size - mid) {
+        i = p->nodes[0].next;
+        for (uint32_t n = 0; n < mid; n++)
+            i = p->nodes[i].next;
+    } else {
+        i = p->nodes[0].prev;
+        for (uint32_t n = q->size - 1; n > mid; n--)
+            i = p->nodes[i].prev;
+    }
+    pool_delete(p, i);
+    pool_compact(p);
+}
+
+static void pool_delete_dup(queue_t *q)
+{
+    pool_t *p = pool_of(q);
+    uint32_t i = p->nodes[0].next;
+
+    while (i) {
+        uint32_t next = p->nodes[i].next;
+        bool dup = false;
+        while (next && !node_cmp(p, i, next, false)) {
+            uint32_t tmp = p->nodes[next].next;
+            pool_delete(p, next);
+            next = tmp;
+            dup = true;
+        }
+        if (dup)
+            pool_delete(p, i);
+        i = next;
+    }
+    pool_compact(p);
+}
+
+/* Exchange the strings of two nodes, leaving the links alone */
+static inline void pool_exchange(pool_t *p, uint32_t a, uint32_t b)
+{
+    pnode_t *x = &p->nodes[a], *y = &p->nodes[b];
+    pnode_t tmp = *x;
+
+    x->off = y->off;
+    x->len = y->len;
+    x->key = y->key;
+    y->off = tmp.off;
+    y->len = tmp.len;
+    y->key = tmp.key;
+}
+
+static void pool_swap(queue_t *q)
+{
+    pool_t *p = pool_of(q);
+
+    for (uint32_t i = p->nodes[0].next; i && p->nodes[i].next;
+         i = p->nodes[p->nodes[i].next].next)
+        pool_exchange(p, i, p->nodes[i].next);
+}
+
+static void pool_reverse(queue_t *q)
+{
+    pool_t *p = pool_of(q);
+    uint32_t i = 0;
+
+    // 與 reverse_list() 相同，對調每個節點（含哨兵）的兩個索引
+    do {
+        uint32_t next = p->nodes[i].next;
+        p->nodes[i].next = p->nodes[i].prev;
+        p->nodes[i].prev = next;
+        i = next;
+    } while (i);
+}
+
+static void pool_reverseK(queue_t *q, int k)
+{
+    pool_t *p = pool_of(q);
+    uint32_t first = p->nodes[0].next;
+
+    for (int left = q->size; left >= k; left -= k) {
+        uint32_t last = first;
+        for (int n = 1; n < k; n++)
+            last = p->nodes[last].next;
+        uint32_t after = p->nodes[last].next;
+
+        uint32_t a = first, b = last;
+        for (int n = 0; n < k / 2; n++) {
+            pool_exchange(p, a, b);
+            a = p->nodes[a].next;
+            b = p->nodes[b].prev;
+        }
+        first = after;
+    }
+}
+
+/* Merge two runs linked through next and ended by index 0, taking from a on
+ * ties to stay stable
+ */
+static uint32_t merge_runs(pool_t *p, uint32_t a, uint32_t b, bool descend)
+{
+    uint32_t head = 0, *tail = &head;
+
+    while (a && b) {
+        if (node_cmp(p, a, b, descend) <= 0) {
+            *tail = a;
+            a = p->nodes[a].next;
+        } else {
+            *tail = b;
+            b = p->nodes[b].next;
+        }
+        tail = &p->nodes[*tail].next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/* Bottom-up merge sort over natural runs, as the list backend does it, on
+ * indices instead of pointers. Each queue appended by pool_merge() is a run
+ * of its own, so merging k queues takes O(N log k) comparisons.
+ */
+static void pool_sort(queue_t *q, bool descend)
+{
+    pool_t *p = pool_of(q);
+    uint32_t runs[64] = {0};
+    int slots = 0;
+
+    p->nodes[p->nodes[0].prev].next = 0;
+    uint32_t list = p->nodes[0].next;
+    while (list) {
+        uint32_t run = list, last = list, next;
+        while ((next = p->nodes[last].next) &&
+               node_cmp(p, last, next, descend) <= 0)
+            last = next;
+        p->nodes[last].next = 0;
+        list = next;
+
+        int i;
+        for (i = 0; runs[i]; i++) {
+            run = merge_runs(p, runs[i], run, descend);
+            runs[i] = 0;
+        }
+        runs[i] = run;
+        if (i >= slots)
+            slots = i + 1;
+    }
+
+    for (int i = 0; i < slots; i++) {
+        if (runs[i])
+            list = list ? merge_runs(p, runs[i], list, descend) : runs[i];
+    }
+
+    // 重建 prev 索引與環狀結構
+    uint32_t prev = 0;
+    for (uint32_t i = list; i; i = p->nodes[i].next) {
+        p->nodes[i].prev = prev;
+        p->nodes[prev].next = i;
+        prev = i;
+    }
+    p->nodes[prev].next = 0;
+    p->nodes[0].prev = prev;
+}
+
+static void pool_monotonic(queue_t *q, bool descend)
+{
+    pool_t *p = pool_of(q);
+    uint32_t kept = p->nodes[0].prev;
+
+    for (uint32_t i = p->nodes[kept].prev; i;) {
+        uint32_t prev = p->nodes[i].prev;
+        if (node_cmp(p, i, kept, descend) > 0)
+            pool_delete(p, i);
+        else
+            kept = i;
+        i = prev;
+    }
+    pool_compact(p);
+}
+
+/* Build an element for every node, all or none */
+static bool pool_detach(queue_t *q, struct list_head *list)
+{
+    pool_t *p = pool_of(q);
+    struct list_head built;
+
+    INIT_LIST_HEAD(&built);
+    for (uint32_t i = p->nodes[0].next; i; i = p->nodes[i].next) {
+        element_t *e = element_new(node_value(p, i), p->nodes[i].len);
+        if (!e) {
+            q_release_list(&built);
+            return false;
+        }
+        list_add_tail(&e->list, &built);
+    }
+    list_splice_tail(&built, list);
+    pool_clear(p);
+    return true;
+}
+
+/* Empty a queue of any engine whose strings have been copied */
+static void drain(queue_t *q)
+{
+    struct list_head list;
+
+    if (q->ops == &pool_ops) {
+        pool_clear(pool_of(q));
+        return;
+    }
+
+    INIT_LIST_HEAD(&list);
+    if (q->ops) {
+        q->ops->detach(q, &list);
+    } else {
+        list_splice_init(&q->head, &list);
+        q->size = 0;
+        q->reversed = false;
+    }
+    q_release_list(&list);
+}
+
+/* Copy the strings of every other queue of the chain to the tail, in chain
+ * order, and sort the result. Room for all of them is made first, so that a
+ * failed allocation leaves the chain untouched.
+ */
+static int pool_merge(queue_t *q, struct list_head *chain, bool descend)
+{
+    pool_t *p = pool_of(q);
+    queue_contex_t *cur;
+    size_t n = 0, bytes = 0;
+    q_iter_t it;
+
+    list_for_each_entry (cur, chain, chain) {
+        if (q_header(cur->q) == q)
+            continue;
+        for (bool ok = q_iter_first(cur->q, &it); ok; ok = q_iter_next(&it)) {
+            n++;
+            bytes += it.len + 1;
+        }
+    }
+    if (!pool_reserve(p, n, bytes))
+        return q->size;
+
+    list_for_each_entry (cur, chain, chain) {
+        if (q_header(cur->q) == q)
+            continue;
+        for (bool ok = q_iter_first(cur->q, &it); ok; ok = q_iter_next(&it))
+            pool_push(p, it.value, it.len, true);
+        drain(q_header(cur->q));
+    }
+    if (q->size > 1)
+        pool_sort(q, descend);
+    return q->size;
+}
+
+static inline bool pool_iter_set(q_iter_t *it)
+{
+    const pool_t *p = pool_of(it->q);
+    it->value = node_value(p, it->index);
+    it->len = p->nodes[it->index].len;
+    it->id = it->value;
+    return true;
+}
+
+static bool pool_iter_end(q_iter_t *it, bool last)
+{
+    const pool_t *p = pool_of(it->q);
+    it->index = last ? p->nodes[0].prev : p->nodes[0].next;
+    return pool_iter_set(it);
+}
+
+static bool pool_iter_step(q_iter_t *it, bool back)
+{
+    const pool_t *p = pool_of(it->q);
+    uint32_t i = back ? p->nodes[it->index].prev : p->nodes[it->index].next;
+    if (!i)
+        return false;
+    it->index = i;
+    return pool_iter_set(it);
+}
+
+const struct queue_ops pool_ops = {
+    .backend = Q_BACKEND_POOL,
+    .create = pool_create,
+    .destroy = pool_destroy,
+    .insert = pool_insert,
+    .insert_owned = pool_insert_owned,
+    .remove = pool_remove,
+    .drop = pool_drop,
+    .delete_mid = pool_delete_mid,
+    .delete_dup = pool_delete_dup,
+    .swap = pool_swap,
+    .reverse = pool_reverse,
+    .reverseK = pool_reverseK,
+    .sort = pool_sort,
+    .monotonic = pool_monotonic,
+    .detach = pool_detach,
+    .merge = pool_merge,
+    .iter_end = pool_iter_end,
+    .iter_step = pool_iter_step,
+};
@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue_backend.h"
+
+/* Ring buffer storage engine
+ *
+ * The queue is a circular array of pointers to elements, whose capacity is a
+ * power of two so that logical positions map to slots with a mask.  Both ends
+ * grow and shrink in constant time, a walk reads consecutive pointers instead
+ * of chasing links, and positions are reached by index, so q_delete_mid() and
+ * q_reverseK() need no walk at all.
+ *
+ * Elements come from the slab cache of queue.c like those of the list, so
+ * q_remove_head() hands them out unchanged.  Their list nodes are unused while
+ * in the ring; sorting and merging borrow them to link the elements for the
+ * merge sort of the list, whose result is written back into the slots.
+ */
+#define RING_MIN_CAPACITY 16
+
+typedef struct {
+    queue_t q;
+    element_t **slots;
+    size_t capacity; /* Zero before the first insertion */
+    size_t first;    /* Slot of the head */
+} ring_t;
+
+static inline ring_t *ring_of(queue_t *q)
+{
+    return container_of(q, ring_t, q);
+}
+
+/* Slot of the element at position i from the head */
+static inline element_t **ring_slot(const ring_t *r, size_t i)
+{
+    return &r->slots[(r->first + i) & (r->capacity - 1)];
+}
+
+/* Make room for n more elements, moving the ring to a larger array if needed.
+ * The ring is unchanged on failure.
+ */
+static bool ring_reserve(ring_t *r, size_t n)
+{
+    size_t size = r->q.size, capacity = r->capacity;
+    if (size + n <= capacity)
+        return true;
+
+    if (!capacity)
+        capacity = RING_MIN_CAPACITY;
+    while (capacity < size + n)
+        capacity <<= 1;
+    element_t **slots = malloc(capacity * sizeof(*slots));
+    if (!slots)
+        return false;
+
+    // 依邏輯順序搬到新陣列的開頭
+    for (size_t i = 0; i < size; i++)
+        slots[i] = *ring_slot(r, i);
+    free(r->slots);
+    r->slots = slots;
+    r->capacity = capacity;
+    r->first = 0;
+    return true;
+}
+
+/* Add e at either end, in room made by ring_reserve() */
+static inline void ring_push(ring_t *r, element_t *e, bool tail)
+{
+    if (tail) {
+        *ring_slot(r, r->q.size) = e;
+    } else {
+        r->first = (r->first - 1) & (r->capacity - 1);
+        r->slots[r->first] = e;
+    }
+    r->q.size++;
+}
+
+static queue_t *ring_create(void)
+{
+    ring_t *r = malloc(sizeof(ring_t));
+    if (!r)
+        return NULL;
+    INIT_LIST_HEAD(&r->q.head);
+    r->q.size = 0;
+    r->q.reversed = false;
+    r->q.ops = &ring_ops;
+    r->slots = NULL;
+    r->capacity = r->first = 0;
+    return &r->q;
+}
+
+static void ring_destroy(queue_t *q)
+{
+    ring_t *r = ring_of(q);
+
+    for (size_t i = 0; i < (size_t) q->size; i++)
+        element_free(*ring_slot(r, i));
+    free(r->slots);
+    free(r);
+}
+
+static bool ring_insert(queue_t *q, const char *s, size_t len, bool tail)
+{
+    ring_t *r = ring_of(q);
+    if (!ring_reserve(r, 1))
+        return false;
+
+    element_t *e = element_new(s, len);
+    if (!e)
+        return false;
+    ring_push(r, e, tail);
+    return true;
+}
+
+static bool ring_insert_owned(queue_t *q, char *s)
+{
+    ring_t *r = ring_of(q);
+    if (!ring_reserve(r, 1))
+        return false;
+
+    element_t *e = element_adopt(s);
+    if (!e)
+        return false;
+    ring_push(r, e, true);
+    return true;
+}
+
+static element_t *ring_remove(queue_t *q, bool tail)
+{
+    ring_t *r = ring_of(q);
+    element_t *e;
+
+    if (tail) {
+        e = *ring_slot(r, q->size - 1);
+    } else {
+        e = r->slots[r->first];
+        r->first = (r->first + 1) & (r->capacity - 1);
+    }
+    q->size--;
+    return e;
+}
+
+static void ring_delete_mid(queue_t *q)
+{
+    ring_t *r = ring_of(q);
+    size_t size = q->size, mid = size / 2;
+
+    element_free(*ring_slot(r, mid));
+    // 移動較短的一側以補上空位
+    if (mid < size - 1 - mid) {
+        for (size_t i = mid; i > 0; i--)
+            *ring_slot(r, i) = *ring_slot(r, i - 1);
+        r->first = (r->first + 1) & (r->capacity - 1);
+    } else {
+        for (size_t i = mid; i + 1 < size; i++)
+            *ring_slot(r, i) = *ring_slot(r, i + 1);
+    }
+    q->size--;
+}
+
+/* Compact the ring in place, dropping every run of equal elements longer
+ * than one
+ */
+static void ring_delete_dup(queue_t *q)
+{
+    ring_t *r = ring_of(q);
+    size_t size = q->size, kept = 0;
+
+    for (size_t i = 0, j; i < size; i = j) {
+        element_t *e = *ring_slot(r, i);
+        for (j = i + 1; j < size && !q_element_cmp(e, *ring_slot(r, j)); j++)
+            ;
+        if (j - i == 1) {
+            *ring_slot(r, kept++) = e;
+            continue;
+        }
+        for (size_t k = i; k < j; k++)
+            element_free(*ring_slot(r, k));
+    }
+    q->size = kept;
+}
+
+static inline void ring_exchange(ring_t *r, size_t i, size_t j)
+{
+    element_t **a = ring_slot(r, i), **b = ring_slot(r, j);
+    element_t *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void ring_swap(queue_t *q)
+{
+    ring_t *r = ring_of(q);
+
+    for (size_t i = 0; i + 1 < (size_t) q->size; i += 2)
+        ring_exchange(r, i, i + 1);
+}
+
+/* Reverse the n elements starting at position from */
+static void ring_reverse_range(ring_t *r, size_t from, size_t n)
+{
+    for (size_t i = from, j = from + n - 1; i < j; i++, j--)
+        ring_exchange(r, i, j);
+}
+
+static void ring_reverse(queue_t *q)
+{
+    ring_reverse_range(ring_of(q), 0, q->size);
+}
+
+static void ring_reverseK(queue_t *q, int k)
+{
+    ring_t *r = ring_of(q);
+
+    for (size_t from = 0; from + k <= (size_t) q->size; from += k)
+        ring_reverse_range(r, from, k);
+}
+
+/* Link the elements through their list nodes, sort them as the list backend
+ * does, and write them back in order. Nothing is allocated.
+ */
+static void ring_sort(queue_t *q, bool descend)
+{
+    ring_t *r = ring_of(q);
+    struct list_head list, *node;
+    size_t i = 0;
+
+    INIT_LIST_HEAD(&list);
+    for (; i < (size_t) q->size; i++)
+        list_add_tail(&(*ring_slot(r, i))->list, &list);
+
+    sort_elements(&list, q->size, descend);
+
+    i = 0;
+    list_for_each (node, &list)
+        *ring_slot(r, i++) = list_entry(node, element_t, list);
+}
+
+/* Scan from the tail, keeping every element not greater (or, when descend is
+ * set, not less) than the last one kept. The survivors are packed against the
+ * tail, so the head simply moves forward.
+ */
+static void ring_monotonic(queue_t *q, bool descend)
+{
+    ring_t *r = ring_of(q);
+    size_t size = q->size, kept = size;
+
+    for (size_t i = size; i-- > 0;) {
+        element_t *e = *ring_slot(r, i);
+        int cmp = kept < size ? q_element_cmp(e, *ring_slot(r, kept)) : 0;
+        if (descend ? cmp < 0 : cmp > 0)
+            element_free(e);
+        else
+            *ring_slot(r, --kept) = e;
+    }
+    r->first = (r->first + kept) & (r->capacity - 1);
+    q->size = size - kept;
+}
+
+static bool ring_detach(queue_t *q, struct list_head *list)
+{
+    ring_t *r = ring_of(q);
+
+    for (size_t i = 0; i < (size_t) q->size; i++)
+        list_add_tail(&(*ring_slot(r, i))->list, list);
+    q->size = 0;
+    r->first = 0;
+    return true;
+}
+
+/* Grow the ring to hold every element of the chain before taking any of them,
+ * so that a failed allocation leaves the chain untouched
+ */
+static int ring_merge(queue_t *q, struct list_head *chain, bool descend)
+{
+    ring_t *r = ring_of(q);
+    queue_contex_t *cur;
+    size_t total = 0;
+
+    list_for_each_entry (cur, chain, chain)
+        total += q_size(cur->q);
+    if (!ring_reserve(r, total - q->size))
+        return q->size;
+
+    struct list_head *node = merge_chain(chain, descend), *next;
+    for (; node; node = next) {
+        next = node->next;
+        ring_push(r, list_entry(node, element_t, list), true);
+    }
+    return q->size;
+}
+
+static inline bool ring_iter_set(q_iter_t *it)
+{
+    const element_t *e = *ring_slot(ring_of(it->q), it->index);
+    it->value = e->value;
+    it->len = e->len;
+    it->id = e;
+    return true;
+}
+
+static bool ring_iter_end(q_iter_t *it, bool last)
+{
+    it->index = last ? it->q->size - 1 : 0;
+    return ring_iter_set(it);
+}
+
+static bool ring_iter_step(q_iter_t *it, bool back)
+{
+    if (back ? !it->index : it->index + 1 >= (size_t) it->q->size)
+        return false;
+    if (back)
+        it->index--;
+    else
+        it->index++;
+    return ring_iter_set(it);
+}
+
+const struct queue_ops ring_ops = {
+    .backend = Q_BACKEND_RING,
+    .create = ring_create,
+    .destroy = ring_destroy,
+    .insert = ring_insert,
+    .insert_owned = ring_insert_owned,
+    .remove = ring_remove,
+    .delete_mid = ring_delete_mid,
+    .delete_dup = ring_delete_dup,
+    .swap = ring_swap,
+    .reverse = ring_reverse,
+    .reverseK = ring_reverseK,
+    .sort = ring_sort,
+    .monotonic = ring_monotonic,
+    .detach = ring_detach,
+    .merge = ring_merge,
+    .iter_end = ring_iter_end,
+    .iter_step = ring_iter_step,
+};
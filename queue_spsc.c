@@ -0,0 +1,115 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue_spsc.h"
+
+/* Elements a side moves before publishing its index */
+#define SPSC_BATCH 32
+
+/* Cache line size. malloc() of the harness does not align the ring beyond 16
+ * bytes, so rather than relying on alignment each side's fields are preceded
+ * by a full line of padding: fields on either side of it are then at least a
+ * line apart, wherever the ring starts.
+ */
+#define SPSC_LINE 64
+
+struct spsc {
+    char pad_front[SPSC_LINE];
+
+    /* Consumer side */
+    atomic_size_t head; /* Published read position */
+    size_t read;        /* Next position to read */
+    size_t tail_seen;   /* Tail as last loaded */
+    char pad_consumer[SPSC_LINE];
+
+    /* Producer side */
+    atomic_size_t tail; /* Published write position */
+    size_t write;       /* Next position to write */
+    size_t head_seen;   /* Head as last loaded */
+    char pad_producer[SPSC_LINE];
+
+    /* Shared, never written after creation */
+    size_t mask;
+    element_t **slots;
+};
+
+spsc_t *spsc_new(size_t capacity)
+{
+    if (!capacity || capacity > (SIZE_MAX >> 1) / sizeof(element_t *))
+        return NULL;
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    spsc_t *q = malloc(sizeof(spsc_t));
+    if (!q)
+        return NULL;
+    q->slots = malloc(size * sizeof(element_t *));
+    if (!q->slots) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->read = q->tail_seen = 0;
+    q->write = q->head_seen = 0;
+    q->mask = size - 1;
+    return q;
+}
+
+void spsc_free(spsc_t *q)
+{
+    if (!q)
+        return;
+    for (size_t i = q->read; i != q->write; i++)
+        q_release_element(q->slots[i & q->mask]);
+    free(q->slots);
+    free(q);
+}
+
+void spsc_flush(spsc_t *q)
+{
+    atomic_store_explicit(&q->tail, q->write, memory_order_release);
+}
+
+bool spsc_push(spsc_t *q, element_t *e)
+{
+    size_t write = q->write;
+
+    if (write - q->head_seen > q->mask) {
+        q->head_seen = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (write - q->head_seen > q->mask) {
+            // 已滿：公開尚未公開的元素，消費者才能清出空間
+            spsc_flush(q);
+            return false;
+        }
+    }
+    q->slots[write & q->mask] = e;
+    q->write = ++write;
+    if (write - atomic_load_explicit(&q->tail, memory_order_relaxed) >=
+        SPSC_BATCH)
+        spsc_flush(q);
+    return true;
+}
+
+element_t *spsc_pop(spsc_t *q)
+{
+    size_t read = q->read;
+
+    if (read == q->tail_seen) {
+        q->tail_seen = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (read == q->tail_seen) {
+            // 已空：公開讀取進度，生產者才看得到全部空位
+            if (atomic_load_explicit(&q->head, memory_order_relaxed) != read)
+                atomic_store_explicit(&q->head, read, memory_order_release);
+            return NULL;
+        }
+    }
+    element_t *e = q->slots[read & q->mask];
+    q->read = ++read;
+    if (read - atomic_load_explicit(&q->head, memory_order_relaxed) >=
+        SPSC_BATCH)
+        atomic_store_explicit(&q->head, read, memory_order_release);
+    return e;
+}
@@ -0,0 +1,70 @@
+#ifndef LAB0_QUEUE_SPSC_H
+#define LAB0_QUEUE_SPSC_H
+
+/* Bounded queue of elements between exactly one producer thread and one
+ * consumer thread.
+ *
+ * It is a ring of pointers to elements whose two indices grow without bound
+ * and are masked into the ring.  Each index is written by one side only and
+ * sits on a cache line of its own, next to that side's cached copy of the
+ * other index, so a side touches the line of the other only when its copy
+ * says the ring is full or empty.  Both sides also publish their index in
+ * batches rather than after every element.  Every call completes in a bounded
+ * number of steps, whatever the other thread does.
+ *
+ * Elements are passed as they are; the queue never allocates or releases
+ * them, so they may come from any queue of queue.h.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef struct spsc spsc_t;
+
+/**
+ * spsc_new() - Create an empty ring
+ * @capacity: number of elements held at most, rounded up to a power of two
+ *
+ * Return: NULL for allocation failed or capacity zero
+ */
+spsc_t *spsc_new(size_t capacity);
+
+/**
+ * spsc_free() - Free the ring, no effect if q is NULL
+ * @q: ring neither thread is using anymore
+ *
+ * Elements still in the ring, published or not, are released.
+ */
+void spsc_free(spsc_t *q);
+
+/**
+ * spsc_push() - Add an element at the tail, from the producer thread
+ * @q: ring
+ * @e: element to hand over to the consumer
+ *
+ * The element becomes visible to the consumer once a batch of them is
+ * complete, the ring fills up, or spsc_flush() is called.
+ *
+ * Return: true for success, false if the ring is full
+ */
+bool spsc_push(spsc_t *q, element_t *e);
+
+/**
+ * spsc_flush() - Make every element pushed so far visible to the consumer
+ * @q: ring
+ *
+ * Called from the producer thread, typically before it goes idle.
+ */
+void spsc_flush(spsc_t *q);
+
+/**
+ * spsc_pop() - Remove the element at the head, from the consumer thread
+ * @q: ring
+ *
+ * Return: the element, NULL if no published element is left
+ */
+element_t *spsc_pop(spsc_t *q);
+
+#endif /* LAB0_QUEUE_SPSC_H */
@@ -0,0 +1,612 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue_backend.h"
+
+/* Unrolled list storage engine
+ *
+ * The queue is a doubly-linked list of cache-line-aligned blocks, each holding
+ * up to UNROLL_SLOTS pointers to elements in a contiguous range of slots.  The
+ * head block fills towards its first slot and the tail block towards its last
+ * one, so both ends grow and shrink in constant time.  Next to every pointer
+ * the block keeps the comparison key of the element, so walks that compare
+ * neighbours, as q_ascend(), q_descend() and q_delete_dup() do, only read the
+ * blocks unless two keys are equal.
+ *
+ * Blocks that become empty go to a spare list, which holds at most one block
+ * except after a queue is detached for q_merge(), where nothing may be freed.
+ */
+#define UNROLL_SLOTS 16
+#define CACHE_LINE 64
+
+typedef struct {
+    struct list_head link; /* Node in the list of blocks or of spare blocks */
+    void *raw;             /* Address returned by malloc() */
+    unsigned int start;    /* First slot in use */
+    unsigned int count;    /* Number of slots in use */
+    uint64_t keys[UNROLL_SLOTS];
+    element_t *slots[UNROLL_SLOTS];
+} ublock_t;
+
+typedef struct {
+    queue_t q;
+    struct list_head blocks;
+    struct list_head spare;
+} unrolled_t;
+
+static inline unrolled_t *unrolled_of(queue_t *q)
+{
+    return container_of(q, unrolled_t, q);
+}
+
+static inline ublock_t *block_of(struct list_head *link)
+{
+    return list_entry(link, ublock_t, link);
+}
+
+/* Allocate a block aligned to a cache line */
+static ublock_t *block_alloc(void)
+{
+    void *raw = malloc(sizeof(ublock_t) + CACHE_LINE - 1);
+    if (!raw)
+        return NULL;
+    ublock_t *b = (ublock_t *) (((uintptr_t) raw + CACHE_LINE - 1) &
+                                ~(uintptr_t) (CACHE_LINE - 1));
+    b->raw = raw;
+    return b;
+}
+
+/* Take a block from the spare list, or allocate one */
+static ublock_t *block_get(unrolled_t *u)
+{
+    if (list_empty(&u->spare))
+        return block_alloc();
+
+    ublock_t *b = block_of(u->spare.next);
+    list_del(&b->link);
+    return b;
+}
+
+/* Unlink an empty block, keeping it as the spare if there is none yet */
+static void block_put(unrolled_t *u, ublock_t *b)
+{
+    list_del(&b->link);
+    if (list_empty(&u->spare))
+        list_add(&b->link, &u->spare);
+    else
+        free(b->raw);
+}
+
+static inline void slot_set(ublock_t *b, unsigned int i, element_t *e)
+{
+    b->slots[i] = e;
+    b->keys[i] = e->key;
+}
+
+/* Compare the elements in two slots, reading them only if their keys tie */
+static inline int slot_cmp(const ublock_t *a,
+                           unsigned int i,
+                           const ublock_t *b,
+                           unsigned int j)
+{
+    if (a->keys[i] != b->keys[j])
+        return a->keys[i] < b->keys[j] ? -1 : 1;
+    return q_element_cmp(a->slots[i], b->slots[j]);
+}
+
+/* Position of an element: its block and slot */
+typedef struct {
+    ublock_t *b;
+    unsigned int i;
+} upos_t;
+
+static inline upos_t pos_first(unrolled_t *u)
+{
+    ublock_t *b = block_of(u->blocks.next);
+    return (upos_t){b, b->start};
+}
+
+static inline upos_t pos_last(unrolled_t *u)
+{
+    ublock_t *b = block_of(u->blocks.prev);
+    return (upos_t){b, b->start + b->count - 1};
+}
+
+/* Step towards the tail; the caller knows there is an element there */
+static inline void pos_next(upos_t *p)
+{
+    if (++p->i == p->b->start + p->b->count) {
+        p->b = block_of(p->b->link.next);
+        p->i = p->b->start;
+    }
+}
+
+static inline void pos_prev(upos_t *p)
+{
+    if (p->i-- == p->b->start) {
+        p->b = block_of(p->b->link.prev);
+        p->i = p->b->start + p->b->count - 1;
+    }
+}
+
+static inline void pos_exchange(upos_t a, upos_t b)
+{
+    element_t *tmp = a.b->slots[a.i];
+    slot_set(a.b, a.i, b.b->slots[b.i]);
+    slot_set(b.b, b.i, tmp);
+}
+
+static queue_t *unrolled_create(void)
+{
+    unrolled_t *u = malloc(sizeof(unrolled_t));
+    if (!u)
+        return NULL;
+    INIT_LIST_HEAD(&u->q.head);
+    u->q.size = 0;
+    u->q.reversed = false;
+    u->q.ops = &unrolled_ops;
+    INIT_LIST_HEAD(&u->blocks);
+    INIT_LIST_HEAD(&u->spare);
+    return &u->q;
+}
+
+static void unrolled_destroy(queue_t *q)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b, *safe;
+
+    list_for_each_entry_safe (b, safe, &u->blocks, link) {
+        for (unsigned int i = 0; i < b->count; i++)
+            element_free(b->slots[b->start + i]);
+        free(b->raw);
+    }
+    list_for_each_entry_safe (b, safe, &u->spare, link)
+        free(b->raw);
+    free(u);
+}
+
+/* Return the end block with a free slot on the outer side, adding a block if
+ * the current one is full. NULL on allocation failure.
+ */
+static ublock_t *end_block(unrolled_t *u, bool tail)
+{
+    if (!list_empty(&u->blocks)) {
+        ublock_t *b = block_of(tail ? u->blocks.prev : u->blocks.next);
+        if (tail ? b->start + b->count < UNROLL_SLOTS : b->start > 0)
+            return b;
+    }
+
+    ublock_t *b = block_get(u);
+    if (!b)
+        return NULL;
+    b->start = tail ? 0 : UNROLL_SLOTS;
+    b->count = 0;
+    if (tail)
+        list_add_tail(&b->link, &u->blocks);
+    else
+        list_add(&b->link, &u->blocks);
+    return b;
+}
+
+/* Store e in the free slot of the end block */
+static inline void end_push(unrolled_t *u,
+                            ublock_t *b,
+                            element_t *e,
+                            bool tail)
+{
+    if (!tail)
+        b->start--;
+    slot_set(b, tail ? b->start + b->count : b->start, e);
+    b->count++;
+    u->q.size++;
+}
+
+/* Release the end block again if it was added for an insertion that failed */
+static inline void end_unget(unrolled_t *u, ublock_t *b)
+{
+    if (!b->count)
+        block_put(u, b);
+}
+
+static bool unrolled_insert(queue_t *q, const char *s, size_t len, bool tail)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b = end_block(u, tail);
+    if (!b)
+        return false;
+
+    element_t *e = element_new(s, len);
+    if (!e) {
+        end_unget(u, b);
+        return false;
+    }
+    end_push(u, b, e, tail);
+    return true;
+}
+
+static bool unrolled_insert_owned(queue_t *q, char *s)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b = end_block(u, true);
+    if (!b)
+        return false;
+
+    element_t *e = element_adopt(s);
+    if (!e) {
+        end_unget(u, b);
+        return false;
+    }
+    end_push(u, b, e, true);
+    return true;
+}
+
+static element_t *unrolled_remove(queue_t *q, bool tail)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b = block_of(tail ? u->blocks.prev : u->blocks.next);
+    element_t *e;
+
+    if (tail) {
+        e = b->slots[b->start + b->count - 1];
+    } else {
+        e = b->slots[b->start];
+        b->start++;
+    }
+    if (!--b->count)
+        block_put(u, b);
+    q->size--;
+    return e;
+}
+
+static void unrolled_delete_mid(queue_t *q)
+{
+    unrolled_t *u = unrolled_of(q);
+    size_t mid = q->size / 2, before = 0;
+    ublock_t *b;
+
+    // 以區塊為單位跳過前段，再於區塊內定位
+    if (mid < (size_t) q->size - mid) {
+        for (b = block_of(u->blocks.next); before + b->count <= mid;
+             b = block_of(b->link.next))
+            before += b->count;
+    } else {
+        before = q->size;
+        b = block_of(u->blocks.prev);
+        for (before -= b->count; before > mid; before -= b->count)
+            b = block_of(b->link.prev);
+    }
+
+    unsigned int i = b->start + (mid - before);
+    element_free(b->slots[i]);
+    // 移動區塊內較短的一側
+    if (i - b->start < b->start + b->count - 1 - i) {
+        memmove(&b->slots[b->start + 1], &b->slots[b->start],
+                (i - b->start) * sizeof(b->slots[0]));
+        memmove(&b->keys[b->start + 1], &b->keys[b->start],
+                (i - b->start) * sizeof(b->keys[0]));
+        b->start++;
+    } else {
+        unsigned int after = b->start + b->count - 1 - i;
+        memmove(&b->slots[i], &b->slots[i + 1], after * sizeof(b->slots[0]));
+        memmove(&b->keys[i], &b->keys[i + 1], after * sizeof(b->keys[0]));
+    }
+    if (!--b->count)
+        block_put(u, b);
+    q->size--;
+}
+
+/* Output side of the operations deleting elements in a single pass. Elements
+ * are written packed from the first slot of the first block on; since blocks
+ * hold at most UNROLL_SLOTS elements, writing never overtakes reading.
+ */
+typedef struct {
+    unrolled_t *u;
+    ublock_t *b;    /* Block being filled */
+    unsigned int n; /* Number of slots filled in b */
+    size_t size;    /* Number of elements written */
+} upack_t;
+
+static void pack_init(upack_t *w, unrolled_t *u)
+{
+    w->u = u;
+    w->b = block_of(u->blocks.next);
+    w->n = 0;
+    w->size = 0;
+}
+
+static void pack_push(upack_t *w, ublock_t *from, unsigned int i)
+{
+    if (w->n == UNROLL_SLOTS) {
+        w->b->start = 0;
+        w->b->count = UNROLL_SLOTS;
+        w->b = block_of(w->b->link.next);
+        w->n = 0;
+    }
+    w->b->slots[w->n] = from->slots[i];
+    w->b->keys[w->n] = from->keys[i];
+    w->n++;
+    w->size++;
+}
+
+/* Slot of the last element written; there must be one */
+static inline upos_t pack_last(const upack_t *w)
+{
+    if (w->n)
+        return (upos_t){w->b, w->n - 1};
+    return (upos_t){block_of(w->b->link.prev), UNROLL_SLOTS - 1};
+}
+
+/* Take back the last element written and release it */
+static void pack_drop(upack_t *w)
+{
+    if (!w->n) {
+        w->b = block_of(w->b->link.prev);
+        w->n = UNROLL_SLOTS;
+    }
+    element_free(w->b->slots[--w->n]);
+    w->size--;
+}
+
+/* Settle the block being filled and release the blocks past it */
+static void pack_finish(upack_t *w)
+{
+    unrolled_t *u = w->u;
+    ublock_t *b, *safe;
+
+    w->b->start = 0;
+    w->b->count = w->n;
+    for (b = block_of(w->b->link.next); &b->link != &u->blocks; b = safe) {
+        safe = block_of(b->link.next);
+        block_put(u, b);
+    }
+    if (!w->n)
+        block_put(u, w->b);
+    u->q.size = w->size;
+}
+
+static void unrolled_delete_dup(queue_t *q)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b;
+    upack_t w;
+    bool dup = false;
+
+    pack_init(&w, u);
+    list_for_each_entry (b, &u->blocks, link) {
+        // 先記下區塊的範圍，寫入端追上此區塊時會改動 start 與 count
+        unsigned int end = b->start + b->count;
+        for (unsigned int i = b->start; i < end; i++) {
+            // 與最後寫入的元素相同者直接釋放，整段重複結束時再撤回該元素
+            if (w.size) {
+                upos_t last = pack_last(&w);
+                if (!slot_cmp(last.b, last.i, b, i)) {
+                    element_free(b->slots[i]);
+                    dup = true;
+                    continue;
+                }
+            }
+            if (dup)
+                pack_drop(&w);
+            dup = false;
+            pack_push(&w, b, i);
+        }
+    }
+    if (dup)
+        pack_drop(&w);
+    pack_finish(&w);
+}
+
+/* Keep the written elements as a monotonic stack: an element arriving drops
+ * every element before it that it is strictly less (or, when descend is set,
+ * strictly greater) than.
+ */
+static void unrolled_monotonic(queue_t *q, bool descend)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b;
+    upack_t w;
+
+    pack_init(&w, u);
+    list_for_each_entry (b, &u->blocks, link) {
+        unsigned int end = b->start + b->count;
+        for (unsigned int i = b->start; i < end; i++) {
+            while (w.size) {
+                upos_t last = pack_last(&w);
+                int cmp = slot_cmp(last.b, last.i, b, i);
+                if (descend ? cmp >= 0 : cmp <= 0)
+                    break;
+                pack_drop(&w);
+            }
+            pack_push(&w, b, i);
+        }
+    }
+    pack_finish(&w);
+}
+
+static void unrolled_swap(queue_t *q)
+{
+    upos_t p = pos_first(unrolled_of(q));
+
+    for (int n = q->size; n >= 2; n -= 2) {
+        upos_t next = p;
+        pos_next(&next);
+        pos_exchange(p, next);
+        if (n > 2) {
+            p = next;
+            pos_next(&p);
+        }
+    }
+}
+
+/* Reverse the n elements from a to b */
+static void reverse_range(upos_t a, upos_t b, int n)
+{
+    for (int i = 0; i < n / 2; i++) {
+        pos_exchange(a, b);
+        pos_next(&a);
+        pos_prev(&b);
+    }
+}
+
+static void unrolled_reverse(queue_t *q)
+{
+    unrolled_t *u = unrolled_of(q);
+    reverse_range(pos_first(u), pos_last(u), q->size);
+}
+
+static void unrolled_reverseK(queue_t *q, int k)
+{
+    upos_t from = pos_first(unrolled_of(q));
+
+    for (int left = q->size; left >= k; left -= k) {
+        upos_t to = from;
+        for (int i = 1; i < k; i++)
+            pos_next(&to);
+        reverse_range(from, to, k);
+        if (left > k) {
+            from = to;
+            pos_next(&from);
+        }
+    }
+}
+
+/* Link the elements through their list nodes, sort them as the list backend
+ * does, and write them back into the same slots. Nothing is allocated.
+ */
+static void unrolled_sort(queue_t *q, bool descend)
+{
+    unrolled_t *u = unrolled_of(q);
+    struct list_head list, *node;
+    ublock_t *b;
+
+    INIT_LIST_HEAD(&list);
+    list_for_each_entry (b, &u->blocks, link) {
+        for (unsigned int i = 0; i < b->count; i++)
+            list_add_tail(&b->slots[b->start + i]->list, &list);
+    }
+
+    sort_elements(&list, q->size, descend);
+
+    node = list.next;
+    list_for_each_entry (b, &u->blocks, link) {
+        for (unsigned int i = 0; i < b->count; i++, node = node->next)
+            slot_set(b, b->start + i, list_entry(node, element_t, list));
+    }
+}
+
+/* Move the elements to the list and every block to the spare list, freeing
+ * nothing
+ */
+static bool unrolled_detach(queue_t *q, struct list_head *list)
+{
+    unrolled_t *u = unrolled_of(q);
+    ublock_t *b;
+
+    list_for_each_entry (b, &u->blocks, link) {
+        for (unsigned int i = 0; i < b->count; i++)
+            list_add_tail(&b->slots[b->start + i]->list, list);
+    }
+    list_splice_init(&u->blocks, &u->spare);
+    q->size = 0;
+    return true;
+}
+
+/* Gather on the spare list every block the merged queue needs before taking
+ * any element, so that a failed allocation leaves the chain untouched
+ */
+static int unrolled_merge(queue_t *q, struct list_head *chain, bool descend)
+{
+    unrolled_t *u = unrolled_of(q);
+    queue_contex_t *cur;
+    size_t total = 0, have = 0;
+    struct list_head *node;
+
+    list_for_each_entry (cur, chain, chain)
+        total += q_size(cur->q);
+    list_for_each (node, &u->blocks)
+        have++;
+    list_for_each (node, &u->spare)
+        have++;
+    for (; have * UNROLL_SLOTS < total; have++) {
+        ublock_t *b = block_alloc();
+        if (!b)
+            return q->size;
+        list_add(&b->link, &u->spare);
+    }
+
+    struct list_head *next;
+    for (node = merge_chain(chain, descend); node; node = next) {
+        next = node->next;
+        end_push(u, end_block(u, true), list_entry(node, element_t, list),
+                 true);
+    }
+
+    // 只留下一個備用區塊
+    while (!list_empty(&u->spare) && u->spare.next != u->spare.prev) {
+        ublock_t *extra = block_of(u->spare.next);
+        list_del(&extra->link);
+        free(extra->raw);
+    }
+    return q->size;
+}
+
+static inline bool unrolled_iter_set(q_iter_t *it)
+{
+    const element_t *e = ((ublock_t *) it->pos)->slots[it->index];
+    it->value = e->value;
+    it->len = e->len;
+    it->id = e;
+    return true;
+}
+
+static bool unrolled_iter_end(q_iter_t *it, bool last)
+{
+    unrolled_t *u = unrolled_of(it->q);
+    upos_t p = last ? pos_last(u) : pos_first(u);
+    it->pos = p.b;
+    it->index = p.i;
+    return unrolled_iter_set(it);
+}
+
+static bool unrolled_iter_step(q_iter_t *it, bool back)
+{
+    unrolled_t *u = unrolled_of(it->q);
+    ublock_t *b = it->pos;
+
+    if (back ? it->index > b->start : it->index + 1 < b->start + b->count) {
+        if (back)
+            it->index--;
+        else
+            it->index++;
+        return unrolled_iter_set(it);
+    }
+
+    struct list_head *link = back ? b->link.prev : b->link.next;
+    if (link == &u->blocks)
+        return false;
+    b = block_of(link);
+    it->pos = b;
+    it->index = back ? b->start + b->count - 1 : b->start;
+    return unrolled_iter_set(it);
+}
+
+const struct queue_ops unrolled_ops = {
+    .backend = Q_BACKEND_UNROLLED,
+    .create = unrolled_create,
+    .destroy = unrolled_destroy,
+    .insert = unrolled_insert,
+    .insert_owned = unrolled_insert_owned,
+    .remove = unrolled_remove,
+    .delete_mid = unrolled_delete_mid,
+    .delete_dup = unrolled_delete_dup,
+    .swap = unrolled_swap,
+    .reverse = unrolled_reverse,
+    .reverseK = unrolled_reverseK,
+    .sort = unrolled_sort,
+    .monotonic = unrolled_monotonic,
+    .detach = unrolled_detach,
+    .merge = unrolled_merge,
+    .iter_end = unrolled_iter_end,
+    .iter_step = unrolled_iter_step,
+};
@@ -30,6 +30,11 @@
 
 #include "random.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -264,7 +269,7 @@ static int bsd_randombytes(void *buf, size_t n)
     /* We prefer CCRandomGenerateBytes as it returns an error code while
      * arc4random_buf may fail silently on macOS.
      */
-    return (CCRandomGenerateBytes(buf, n) == kCCSuccess);
+    return CCRandomGenerateBytes(buf, n) == kCCSuccess ? 0 : -1;
 #else
     arc4random_buf(buf, n);
     return 0;
@@ -272,7 +277,8 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Read n bytes straight from the kernel, which is only needed for seeding */
+static int sys_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +297,209 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Buffered ChaCha20 generator. Each thread keeps a pool that is seeded once
+ * from the kernel and refilled RANDOM_POOL_BLOCKS blocks at a time, so that
+ * most requests are served by a memcpy() instead of a system call. After every
+ * refill the first 32 bytes of output become the next key and are wiped
+ * (fast key erasure), and bytes are wiped once handed out, so a later copy of
+ * the pool does not reveal earlier output.
+ */
+#define RANDOM_POOL_BLOCKS 16
+#define CHACHA_BLOCK_BYTES 64
+#define CHACHA_KEY_BYTES 32
+
+typedef struct {
+    uint32_t key[CHACHA_KEY_BYTES / 4];
+    uint8_t buf[CHACHA_BLOCK_BYTES * RANDOM_POOL_BLOCKS];
+    size_t avail;  /* Unread bytes at the end of buf */
+    unsigned gen;  /* Value of fork_gen when the pool was seeded */
+    bool seeded;
+} random_pool_t;
+
+static __thread random_pool_t pool;
+
+/* Bumped in the child after fork(), which must not replay the parent's pool */
+static volatile unsigned fork_gen;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void random_atfork_child(void)
+{
+    fork_gen++;
+}
+
+static void random_atfork_init(void)
+{
+    pthread_atfork(NULL, NULL, random_atfork_child);
+}
+
+#define ROTL32(v, n) ((v) << (n) | (v) >> (32 - (n)))
+
+#define CHACHA_QR(a, b, c, d) \
+    do {                      \
+        a += b;               \
+        d ^= a;               \
+        d = ROTL32(d, 16);    \
+        c += d;               \
+        b ^= c;               \
+        b = ROTL32(b, 12);    \
+        a += b;               \
+        d ^= a;               \
+        d = ROTL32(d, 8);     \
+        c += d;               \
+        b ^= c;               \
+        b = ROTL32(b, 7);     \
+    } while (0)
+
+/* Write block number counter of the key stream, with an all-zero nonce */
+static void chacha20_block(const uint32_t key[8], uint32_t counter, uint8_t *out)
+{
+    const uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,  /* "expand 32-byte k" */
+        key[0],     key[1],     key[2],     key[3],
+        key[4],     key[5],     key[6],     key[7],
+        counter,    0,          0,          0,
+    };
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static void pool_refill(void)
+{
+    for (uint32_t i = 0; i < RANDOM_POOL_BLOCKS; i++)
+        chacha20_block(pool.key, i, pool.buf + i * CHACHA_BLOCK_BYTES);
+
+    memcpy(pool.key, pool.buf, CHACHA_KEY_BYTES);
+    memset(pool.buf, 0, CHACHA_KEY_BYTES);
+    pool.avail = sizeof(pool.buf) - CHACHA_KEY_BYTES;
+}
+
+static int pool_seed(void)
+{
+    pthread_once(&atfork_once, random_atfork_init);
+
+    unsigned gen = fork_gen;
+    if (sys_randombytes((uint8_t *) pool.key, sizeof(pool.key)))
+        return -1;
+    pool.gen = gen;
+    pool.seeded = true;
+    pool_refill();
+    return 0;
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if ((!pool.seeded || pool.gen != fork_gen) && pool_seed())
+        return -1;
+
+    while (n > 0) {
+        if (!pool.avail)
+            pool_refill();
+
+        size_t chunk = n < pool.avail ? n : pool.avail;
+        uint8_t *src = pool.buf + sizeof(pool.buf) - pool.avail;
+        memcpy(buf, src, chunk);
+        memset(src, 0, chunk);
+        pool.avail -= chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+uint32_t random_u32(void)
+{
+    uint32_t x;
+    if (randombytes((uint8_t *) &x, sizeof(x)))
+        abort();
+    return x;
+}
+
+uint64_t random_u64(void)
+{
+    uint64_t x;
+    if (randombytes((uint8_t *) &x, sizeof(x)))
+        abort();
+    return x;
+}
+
+/* Random draws per batch of random_strings(), one per byte of output */
+#define RANDOM_STRINGS_BATCH 1024
+
+/* Draw n bytes from charset into buf, leaving the draws in r */
+static void random_chars(char *buf,
+                         uint16_t *r,
+                         size_t n,
+                         const char *charset,
+                         size_t charset_len)
+{
+    if (randombytes((uint8_t *) r, n * sizeof(r[0])))
+        abort();
+
+    /* Multiply-shift maps each 16-bit draw onto the charset without a
+     * division or a rejection loop, so the compiler can vectorize it.
+     */
+    for (size_t j = 0; j < n; j++)
+        buf[j] = charset[r[j] * charset_len >> 16];
+}
+
+void random_strings(char *buf,
+                    size_t count,
+                    size_t stride,
+                    size_t min_len,
+                    const char *charset,
+                    size_t charset_len)
+{
+    uint16_t r[RANDOM_STRINGS_BATCH];
+    size_t span = stride - min_len; /* Number of possible lengths */
+    size_t per_batch = RANDOM_STRINGS_BATCH / stride;
+
+    /* A slot longer than a batch is filled one batch at a time */
+    if (!per_batch) {
+        for (; count > 0; count--, buf += stride) {
+            size_t n = 0;
+            for (size_t j = 0; j < stride; j += n) {
+                n = stride - j < RANDOM_STRINGS_BATCH ? stride - j
+                                                       : RANDOM_STRINGS_BATCH;
+                random_chars(buf + j, r, n, charset, charset_len);
+            }
+            buf[min_len + (r[n - 1] * span >> 16)] = '\0';
+        }
+        return;
+    }
+
+    while (count > 0) {
+        size_t k = count < per_batch ? count : per_batch;
+        size_t n = k * stride;
+        random_chars(buf, r, n, charset, charset_len);
+
+        /* The draw behind the last byte of a slot, which is never part of the
+         * string, picks its length.
+         */
+        for (size_t i = 0; i < k; i++) {
+            uint16_t last = r[i * stride + stride - 1];
+            buf[i * stride + min_len + (last * span >> 16)] = '\0';
+        }
+
+        buf += n;
+        count -= k;
+    }
+}
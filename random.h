@@ -4,13 +4,34 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Fill buf with len bytes from a per-thread ChaCha20 pool, which is seeded from
+ * the kernel on first use and again after fork(). Return 0 on success and -1
+ * if the kernel source could not be read.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Random integers drawn from the same pool. The process is aborted if the pool
+ * cannot be seeded.
+ */
+uint32_t random_u32(void);
+uint64_t random_u64(void);
+
+/* Write count random strings into buf, one every stride bytes. Each string has
+ * between min_len and stride - 1 characters taken from the first charset_len
+ * of charset, followed by a null terminator. stride must exceed min_len but is
+ * otherwise unbounded; slots longer than the internal batch of draws are filled
+ * in several draws. The process is aborted if the pool cannot be seeded.
+ */
+void random_strings(char *buf,
+                    size_t count,
+                    size_t stride,
+                    size_t min_len,
+                    const char *charset,
+                    size_t charset_len);
+
 static inline uint8_t randombit(void)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
+    return random_u32() & 1;
 }
 
 #if INTPTR_MAX == INT64_MAX
@@ -8,10 +8,12 @@
 /* Shannon full integer entropy calculation */
 #define BUCKET_SIZE (1 << 8)
 
-double shannon_entropy(const uint8_t *s)
+double shannon_entropy(const uint8_t *s, size_t len)
 {
     assert(s);
-    const uint64_t count = strlen((char *) s);
+    const uint64_t count = len;
+    if (!count)
+        return 0;
     uint64_t entropy_sum = 0;
     const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
 
@@ -0,0 +1,26 @@
+# Test of 'q_ascend' and 'q_descend' keeping the last element and equal values
+new
+it b
+it a
+it c
+it a
+it d
+ascend
+rh a
+rh a
+rh d
+new
+it d
+it b
+it c
+it b
+it a
+descend
+rh d
+rh c
+rh b
+rh a
+new
+it z
+ascend
+rh z
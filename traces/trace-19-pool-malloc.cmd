@@ -0,0 +1,17 @@
+# Test of single and bulk removal from pool queues, which build the removed elements, under malloc failure
+option fail 30
+option malloc 0
+option backend 3
+new
+it RAND 3000
+ih dolphin 10
+option malloc 20
+rh * 3000
+rt * 500
+rh
+rt
+option malloc 0
+it gerbil 20
+rh * 5
+rt gerbil 5
+free
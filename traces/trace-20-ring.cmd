@@ -0,0 +1,71 @@
+# Test of ring queues wrapping around their array, growing while wrapped, and reordering elements across the wrap
+option fail 0
+option malloc 0
+option backend 1
+new
+it a 10
+rh a 8
+it b 10
+ih c 3
+it d 3
+size
+rh c 3
+rh a 2
+rh b 10
+rt d 3
+size
+free
+new
+ih d
+ih c
+ih b
+ih a
+it e
+it f
+it g
+it h
+reverse
+rh h
+rt a
+swap
+rh f
+rh g
+reverseK 3
+rh b
+rh e
+rh d
+rt c
+ih m
+ih k
+ih q
+it n
+it p
+it l
+dm
+sort
+rh k
+rh l
+rh m
+rh p
+rh q
+size
+free
+new
+it x 12
+rh x 10
+it y 2
+it v
+ih w
+sort
+new
+it u
+it z 20
+merge
+rh u
+rh v
+rh w
+rh x 2
+rh y 2
+rh z 20
+size
+free
@@ -0,0 +1,98 @@
+# Test of unrolled queues splitting into new blocks and packing blocks back together at the 16-slot boundary
+option fail 0
+option malloc 0
+option backend 2
+new
+ih h 16
+ih g
+it t 16
+it u
+size
+rh g
+rt u
+size
+dm
+rh h 16
+rh t 15
+size
+it a
+it b
+it c
+it d
+it e
+it f
+it g
+it h
+it i
+it j
+it k
+it l
+it m
+it n
+it o
+it p
+it p
+it q
+dedup
+rh a
+rh b
+rh c
+rh d
+rh e
+rh f
+rh g
+rh h
+rh i
+rh j
+rh k
+rh l
+rh m
+rh n
+rh o
+rh q
+size
+it z 16
+it a
+ascend
+size
+rh a
+it n 15
+it k
+it m 2
+descend
+rh n 15
+rh m 2
+size
+ih e 8
+ih f 8
+ih g
+reverseK 5
+rh f 4
+rh g
+rh e
+rh f 4
+rh e 7
+size
+ih o
+it p 15
+it q
+it r
+swap
+rh p
+rh o
+rh p 14
+rh r
+rh q
+free
+new
+it s 15
+new
+it o 10
+it r 10
+sort
+merge
+rh o 10
+rh r 10
+rh s 15
+size
+free
@@ -0,0 +1,79 @@
+# Test of 'q_merge' across queues of different storage engines
+option fail 0
+option malloc 0
+option backend 1
+new
+ih a
+ih r
+ih b
+sort
+option backend 0
+new
+ih m
+ih n
+ih a
+sort
+option backend 3
+new
+ih r
+ih c
+ih z
+sort
+option backend 2
+new
+it d
+it q
+it a
+sort
+merge
+size
+rh a
+rh a
+rh a
+rh b
+rh c
+rt z
+rt r
+rt r
+reverse
+rh q
+rt d
+free
+option backend 0
+new
+it e
+it k
+option backend 3
+new
+it b
+it f
+it f
+option backend 2
+new
+option backend 1
+new
+it a
+it x
+merge
+dedup
+rh a
+rh b
+rh e
+rh k
+rh x
+size
+free
+option backend 3
+new
+it c
+it d
+option backend 0
+new
+it a
+it b
+merge
+rh a
+rt d
+rh b
+rh c
+free
@@ -0,0 +1,27 @@
+# Test of bulk removal with 'rh' and 'rt', with a count, with or without an expected value, on null, empty and short queues
+option fail 20
+option malloc 0
+rh * 3
+rt * 3
+new
+rh * 2
+rt * 2
+ih dolphin 3
+it gerbil 2
+rh dolphin 2
+rt gerbil 2
+rh dolphin
+size
+ih bear 2
+it meerkat 4
+rh * 3
+rt * 4
+size
+it lion 3
+rt * 10
+size
+it zebra
+rh * 5
+free
+rh * 2
+rt * 2
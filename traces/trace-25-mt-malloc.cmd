@@ -0,0 +1,9 @@
+# Test of the lock-free queue shared by several producer and consumer threads, under malloc failure
+option fail 30
+option malloc 0
+mt_stress 2 2 1000
+option malloc 10
+mt_stress 3 2 1000
+mt_stress 1 4 500
+option malloc 0
+mt_stress 4 1 200
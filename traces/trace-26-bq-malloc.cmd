@@ -0,0 +1,10 @@
+# Test of the blocking queue shared by several producer and consumer threads, under malloc failure
+option fail 30
+option malloc 0
+bq_stress 2 2 1000
+option malloc 10
+bq_stress 3 2 1000
+bq_stress 1 4 500
+bq_stress 2 3 1000
+option malloc 0
+bq_stress 4 1 200
@@ -0,0 +1,41 @@
+# Test of 'q_insert_head_len', 'q_insert_tail_len', 'q_sort', 'q_delete_dup', 'q_ascend', and 'q_descend' with values differing only after a null byte
+option fail 0
+option malloc 0
+new
+itl key\0b
+itl key\0a
+ihl key\0b
+itl key
+itl key\0b\0
+sort
+size
+dedup
+size
+rh key
+rh key
+rt key
+size
+free
+new
+itl x\0c
+itl x\0a
+itl x\0b
+descend
+size
+rh x
+rt x
+free
+new
+ihl y\0a
+ihl y\0b
+ihl y\0c
+ascend
+size
+rh y
+free
+new
+itl a\\0 2
+itl a\0 2
+dedup
+size
+free
@@ -0,0 +1,49 @@
+# Test of 'q_merge' into a list queue, with pool queues in the chain, under malloc failure
+option fail 30
+option malloc 0
+new
+it a 128
+option backend 3
+new
+it b
+it d
+option malloc 100
+merge
+option malloc 0
+size
+rh a 128
+rh
+size
+free
+option backend 0
+new
+it b
+it e
+option backend 3
+new
+it a
+it c
+option backend 2
+new
+it d
+option backend 3
+new
+it f
+option malloc 50
+merge
+option malloc 0
+rh * 6
+free
+option backend 0
+new
+it c
+option backend 3
+new
+it a
+it b
+merge
+size
+rh a
+rh b
+rh c
+free
@@ -0,0 +1,71 @@
+# Test of 'q_sort', 'q_ascend', 'q_descend', 'q_delete_dup', and 'q_merge' with interned strings, in ascending and descending order
+option fail 0
+option malloc 0
+option intern 1
+new
+it gerbil 3
+ih bear 2
+it dolphin
+ih gerbil
+it bear
+sort
+rh bear
+rh bear
+rh bear
+rh dolphin
+rh gerbil 4
+new
+it c
+it a
+it c
+it b
+it a
+ascend
+rh a
+rh a
+size
+new
+it b 2
+it a
+it c 2
+sort
+dedup
+rh a
+size
+free
+option descend 1
+new
+it a
+it c 2
+it b
+sort
+rh c 2
+rh b
+rh a
+new
+it d
+it b
+it d
+it a
+it c
+descend
+rh d
+rh d
+rh c
+size
+new
+it e 2
+it a 2
+sort
+new
+it d
+it b 3
+sort
+merge
+rh e 2
+rh d
+rh b 3
+rh a 2
+free
+option descend 0
+option intern 0